@@ -0,0 +1,128 @@
+// Churns a fixed number of live blocks through reallocate() the way a long
+// running VM does: mostly string-sized blocks, some table- and chunk-sized
+// arrays that grow, and the odd huge one. Reports the cost per operation and
+// how much memory the process holds compared to what is live. CMake builds it
+// with the slab allocator (bench_slab) and with plain malloc (bench_malloc).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+#define OPERATIONS 4000000
+#define LIVE_BLOCKS 20000
+
+typedef struct {
+    uint8_t* pointer;
+    size_t size;
+} Block;
+
+static size_t randomSize();
+static uint32_t nextRandom();
+static size_t residentBytes();
+static double now();
+
+static VM vm;
+static uint32_t randomState = 2463534242u;
+
+int main(int argc, const char* argv[]) {
+    int operations = argc > 1 ? atoi(argv[1]) : OPERATIONS;
+
+    initVM(&vm);
+    vm.nextGC = SIZE_MAX; // there are no objects, so there is nothing to collect
+
+    Block* blocks = calloc(LIVE_BLOCKS, sizeof(Block));
+    size_t liveBytes = 0;
+
+    double start = now();
+    for (int i = 0; i < operations; i++) {
+        Block* block = &blocks[nextRandom() % LIVE_BLOCKS];
+        if (block->pointer != NULL && nextRandom() % 8 == 0 && block->size < 1024 * 1024) {
+            // grow it the way GROW_ARRAY does
+            block->pointer = GROW_ARRAY(&vm, uint8_t, block->pointer, block->size, block->size * 2);
+            liveBytes += block->size;
+            block->size *= 2;
+        } else {
+            FREE_ARRAY(&vm, uint8_t, block->pointer, block->size);
+            liveBytes -= block->size;
+            block->size = randomSize();
+            block->pointer = ALLOCATE(&vm, uint8_t, block->size);
+            liveBytes += block->size;
+        }
+        // write to every page of the block, as a caller filling it in would
+        for (size_t offset = 0; offset < block->size; offset += 4096) {
+            block->pointer[offset] = (uint8_t)i;
+        }
+        block->pointer[block->size - 1] = (uint8_t)i;
+    }
+    double elapsed = now() - start;
+
+    size_t resident = residentBytes();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#if defined(SLAB_ALLOCATOR) && defined(HUGE_PAGES)
+    printf("allocator:   slabs, huge pages for mapped blocks\n");
+#elif defined(SLAB_ALLOCATOR)
+    printf("allocator:   slabs\n");
+#else
+    printf("allocator:   malloc\n");
+#endif
+    printf("operations:  %d in %.3f s, %.0f ns/operation\n", operations, elapsed, elapsed * 1e9 / operations);
+    printf("live:        %.1f MB in %d blocks\n", liveBytes / 1e6, LIVE_BLOCKS);
+    printf("resident:    %.1f MB, %.2fx live\n", resident / 1e6, (double)resident / liveBytes);
+    printf("peak RSS:    %.1f MB\n", usage.ru_maxrss / 1e3);
+
+    for (int i = 0; i < LIVE_BLOCKS; i++) {
+        FREE_ARRAY(&vm, uint8_t, blocks[i].pointer, blocks[i].size);
+    }
+    free(blocks);
+    freeVM(&vm);
+    return 0;
+}
+
+// mostly strings, then arrays of every size, then a few huge arrays
+static size_t randomSize() {
+    uint32_t kind = nextRandom() % 1000;
+    if (kind < 700) {
+        return 25 + nextRandom() % 96;
+    }
+    if (kind < 900) {
+        return 128 + nextRandom() % 1920;
+    }
+    if (kind < 999) {
+        return 2048 + nextRandom() % (62 * 1024);
+    }
+    return 256 * 1024 + nextRandom() % (768 * 1024);
+}
+
+// xorshift32, so that every build sees the same sequence
+static uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static size_t residentBytes() {
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,81 @@
+// Formats log lines with long chains of + on strings, the way our scripts do,
+// and reports how long that takes and how much it allocates.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+
+#define STATEMENTS 20000
+#define RUNS 20
+
+static char* makeWorkload(int statements);
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int statements = argc > 1 ? atoi(argv[1]) : STATEMENTS;
+    int runs = argc > 2 ? atoi(argv[2]) : RUNS;
+
+    initVM(&vm);
+
+    char* source = makeWorkload(statements);
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(&vm, source, &chunk)) {
+        fprintf(stderr, "Could not compile the workload.\n");
+        return 65;
+    }
+    free(source);
+
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        if (interpretChunk(&vm, &chunk) != INTERPRET_OK) {
+            fprintf(stderr, "The workload failed.\n");
+            return 70;
+        }
+    }
+    double elapsed = now() - start;
+    int lines = statements * runs;
+
+    printf("lines:       %d, 8 operands each\n", lines);
+    printf("run():       %.3f s, %.0f ns/line\n", elapsed, elapsed * 1e9 / lines);
+    printf("allocated:   %.1f MB, %.0f bytes/line\n",
+           vm.gcStats.bytesRequested / 1e6, (double)vm.gcStats.bytesRequested / lines);
+    printf("allocations: %llu, %.2f per line\n",
+           (unsigned long long)vm.gcStats.allocations, (double)vm.gcStats.allocations / lines);
+
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+// Lox has no loops yet, so the loop is unrolled. Each line starts with a
+// distinct id, so every intermediate result is a new string too.
+static char* makeWorkload(int statements) {
+    size_t capacity = 256 + (size_t)statements * 96;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source,
+        "var level = \"INFO\";\n"
+        "var module = \"scheduler\";\n"
+        "var message = \"job finished\";\n"
+        "var line = \"\";\n");
+
+    for (int i = 0; i < statements; i++) {
+        length += sprintf(source + length,
+            "line = \"#\" + \"%d\" + \" [\" + level + \"] \" + module + \": \" + message;\n", i);
+    }
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
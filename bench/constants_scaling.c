@@ -0,0 +1,79 @@
+// Compiles and runs a single chunk with about a million distinct constants and
+// a quarter million globals, far beyond what one-byte operands can address, to
+// show how compile() and run() scale once the wide instructions kick in.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+
+#define STATEMENTS 800000
+
+static char* makeWorkload(int statements);
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int statements = argc > 1 ? atoi(argv[1]) : STATEMENTS;
+
+    initVM(&vm);
+
+    char* source = makeWorkload(statements);
+    Chunk chunk;
+    initChunk(&chunk);
+
+    double start = now();
+    if (!compile(&vm, source, &chunk)) {
+        fprintf(stderr, "Could not compile the workload.\n");
+        return 65;
+    }
+    double compileTime = now() - start;
+
+    start = now();
+    if (interpretChunk(&vm, &chunk) != INTERPRET_OK) {
+        fprintf(stderr, "The workload failed.\n");
+        return 70;
+    }
+    double runTime = now() - start;
+
+    printf("source:     %zu bytes, %d statements\n", strlen(source), statements);
+    printf("bytecode:   %d bytes\n", chunk.count);
+    printf("line table: %zu bytes (%d runs)\n", chunk.lineCapacity * sizeof(LineStart), chunk.lineCount);
+    printf("constants:  %d (%d before deduplication)\n", chunk.constants.count, chunk.constantRequests);
+    printf("globals:    %d\n", vm.globalValues.count);
+    printf("compile():  %.3f s, %.0f ns/statement\n", compileTime, compileTime * 1e9 / statements);
+    printf("run():      %.3f s, %.0f ns/statement\n", runTime, runTime * 1e9 / statements);
+
+    freeChunk(&vm, &chunk);
+    free(source);
+    freeVM(&vm);
+    return 0;
+}
+
+// Every statement adds a new number to a running sum, and every fourth one also
+// defines a new global, so both constants and global slots keep growing.
+static char* makeWorkload(int statements) {
+    size_t capacity = 64 + (size_t)statements * 64;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source, "var sum = 0;\n");
+
+    for (int i = 0; i < statements; i++) {
+        length += sprintf(source + length, "sum = sum + %d;\n", i);
+        if (i % 4 == 0) {
+            length += sprintf(source + length, "var g%d = %d.5;\n", i, i);
+        }
+    }
+    sprintf(source + length, "print sum;\n");
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,164 @@
+// Measures how fast strings from 1 byte to 1 MB are hashed and interned, and
+// checks how evenly both string hashes spread typical keys over the buckets of
+// a table. CMake builds it with each hash: bench_wyhash and bench_fnv1a.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define BYTES_PER_LENGTH (64 * 1024 * 1024)
+#define MAX_STRINGS 200000
+#define BUCKET_BITS 16
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+static void measureLength(Chunk* chunk, int length);
+static void checkDistribution(const char* name, const char* format);
+static double probeLength(HashFn hash, char* keys, int* lengths, int count, int keySize);
+static uint32_t nextRandom();
+static double now();
+
+static VM vm;
+static uint32_t randomState = 2463534242u;
+static volatile uint32_t sink;
+
+int main(int argc, const char* argv[]) {
+    int maxLength = argc > 1 ? atoi(argv[1]) : 1024 * 1024;
+
+    initVM(&vm);
+
+    // the strings are kept alive as the constants of a chunk that is a root
+    Chunk chunk;
+    initChunk(&chunk);
+    vm.chunk = &chunk;
+
+#ifdef STRING_HASH_FNV1A
+    printf("hash: fnv1a\n\n");
+#else
+    printf("hash: wyhash\n\n");
+#endif
+    printf("%8s %8s %12s %12s %12s\n", "length", "strings", "hash", "intern", "lookup");
+    for (int length = 1; length <= maxLength; length *= 4) {
+        measureLength(&chunk, length);
+    }
+
+    printf("\naverage probes to find a key, %d keys in %d buckets (uniform: 2.50)\n",
+           (1 << BUCKET_BITS) * 3 / 4, 1 << BUCKET_BITS);
+    printf("%-26s %8s %8s\n", "keys", "wyhash", "fnv1a");
+    checkDistribution("decimal numbers", "%d");
+    checkDistribution("identifiers", "key%d");
+    checkDistribution("paths", "/usr/lib/lox/module_%d.lox");
+    checkDistribution("multiples of 256", "%d00");
+
+    vm.chunk = NULL;
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+// The keys are overlapping windows of one random buffer, so there is no copy
+// per key and the ones longer than a few bytes are all distinct. Reports the
+// throughput of hashing alone, of interning new strings and of looking up
+// interned ones with copyString().
+static void measureLength(Chunk* chunk, int length) {
+    int count = BYTES_PER_LENGTH / length;
+    if (count > MAX_STRINGS) {
+        count = MAX_STRINGS;
+    }
+    char* buffer = malloc((size_t)count + length);
+    for (int i = 0; i < count + length; i++) {
+        buffer[i] = (char)('a' + nextRandom() % 26);
+    }
+
+    double start = now();
+    uint32_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += hashString(buffer + i, length);
+    }
+    double hashTime = now() - start;
+    sink = total;
+
+    chunk->constants.values = GROW_ARRAY(&vm, Value, chunk->constants.values, chunk->constants.capacity, count);
+    chunk->constants.capacity = count;
+    chunk->constants.count = 0;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        writeValueArray(&vm, &chunk->constants, OBJ_VAL(copyString(&vm, buffer + i, length)));
+    }
+    double internTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        total += copyString(&vm, buffer + i, length)->hash;
+    }
+    double lookupTime = now() - start;
+    sink = total;
+
+    double megabytes = (double)count * length / 1e6;
+    printf("%8d %8d %7.0f MB/s %7.0f MB/s %7.0f MB/s\n", length, count,
+           megabytes / hashTime, megabytes / internTime, megabytes / lookupTime);
+
+    // let the next collection take this length's strings
+    chunk->constants.count = 0;
+    collectGarbage(&vm);
+    free(buffer);
+}
+
+static void checkDistribution(const char* name, const char* format) {
+    int count = (1 << BUCKET_BITS) * 3 / 4;
+    int keySize = 64;
+    char* keys = malloc((size_t)count * keySize);
+    int* lengths = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        lengths[i] = snprintf(keys + (size_t)i * keySize, keySize, format, i);
+    }
+
+    printf("%-26s %8.2f %8.2f\n", name,
+           probeLength(hashWyhash, keys, lengths, count, keySize),
+           probeLength(hashFnv1a, keys, lengths, count, keySize));
+
+    free(keys);
+    free(lengths);
+}
+
+// Inserts the hashes into an open-addressed array with linear probing, the way
+// the interning table stores them, and returns the average number of slots a
+// successful lookup looks at.
+static double probeLength(HashFn hash, char* keys, int* lengths, int count, int keySize) {
+    uint32_t capacity = 1u << BUCKET_BITS;
+    uint8_t* used = calloc(capacity, 1);
+    uint64_t probes = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t index = hash(keys + (size_t)i * keySize, lengths[i]) % capacity;
+        probes++;
+        while (used[index]) {
+            index = (index + 1) % capacity;
+            probes++;
+        }
+        used[index] = 1;
+    }
+    free(used);
+    return (double)probes / count;
+}
+
+// xorshift32, so that every build sees the same sequence
+static uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
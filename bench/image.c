@@ -0,0 +1,169 @@
+// Compares two ways of starting a VM with a large table of global
+// configuration: running the script that declares it, and loading a heap image
+// saved after running it once. Every start happens in a fresh child process,
+// so neither finds the shared strings or the allocator warmed up by the other.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "intern.h"
+#include "vm.h"
+
+#define RUNS 5
+
+typedef enum {
+    START_REPLAY,
+    START_IMAGE,
+    START_DUMP,
+} StartMode;
+
+typedef struct {
+    double seconds;
+    int globals; // defined once the VM has started, to check both ways agree
+} Start;
+
+static Start start(StartMode mode, const char* source, const char* imagePath);
+static Start startInChild(StartMode mode, const char* source, const char* imagePath);
+static char* makeScript(int declarations);
+static double now();
+
+int main(int argc, const char* argv[]) {
+    int maxDeclarations = argc > 1 ? atoi(argv[1]) : 100000;
+    char imagePath[64];
+    snprintf(imagePath, sizeof(imagePath), "/tmp/clox-bench-%d.img", (int)getpid());
+
+    printf("best of %d starts, each in a fresh process\n\n", RUNS);
+    printf("%12s %10s %12s %12s %8s\n", "declarations", "image", "replay", "load image", "speedup");
+    for (int declarations = 1000; declarations <= maxDeclarations; declarations *= 10) {
+        char* source = makeScript(declarations);
+        startInChild(START_DUMP, source, imagePath);
+        struct stat status;
+        stat(imagePath, &status);
+
+        Start replay = { 1e9, 0 };
+        Start image = { 1e9, 0 };
+        for (int i = 0; i < RUNS; i++) {
+            Start run = startInChild(START_REPLAY, source, imagePath);
+            if (run.seconds < replay.seconds) {
+                replay = run;
+            }
+            run = startInChild(START_IMAGE, source, imagePath);
+            if (run.seconds < image.seconds) {
+                image = run;
+            }
+        }
+        if (replay.globals != image.globals) {
+            fprintf(stderr, "The image has %d globals instead of %d.\n", image.globals, replay.globals);
+            exit(70);
+        }
+
+        printf("%12d %7.0f KB %9.2f ms %9.2f ms %7.1fx\n", declarations, status.st_size / 1024.0,
+               replay.seconds * 1e3, image.seconds * 1e3, replay.seconds / image.seconds);
+        free(source);
+    }
+
+    unlink(imagePath);
+    return 0;
+}
+
+// Times initVM() and then either running the script or loading the image,
+// which is everything a job has to wait for before it can run.
+static Start start(StartMode mode, const char* source, const char* imagePath) {
+    double begin = now();
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+    initVM(vm);
+
+    bool started;
+    if (mode == START_IMAGE) {
+        started = loadImage(vm, imagePath);
+    } else {
+        started = interpret(vm, source) == INTERPRET_OK;
+    }
+    Start result = { now() - begin, 0 };
+    if (started && mode == START_DUMP) {
+        started = saveImage(vm, imagePath);
+    }
+    if (!started) {
+        exit(70);
+    }
+
+    for (int i = 0; i < vm->globalValues.count; i++) {
+        if (!IS_UNDEFINED(vm->globalValues.values[i])) {
+            result.globals++;
+        }
+    }
+    freeVM(vm);
+    free(vm);
+    freeSharedStrings();
+    return result;
+}
+
+static Start startInChild(StartMode mode, const char* source, const char* imagePath) {
+    int channel[2];
+    if (pipe(channel) != 0) {
+        exit(1);
+    }
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        Start result = start(mode, source, imagePath);
+        write(channel[1], &result, sizeof(result));
+        _exit(0);
+    }
+
+    Start result = { 0, 0 };
+    close(channel[1]);
+    ssize_t received = read(channel[0], &result, sizeof(result));
+    close(channel[0]);
+    int status;
+    waitpid(child, &status, 0);
+    if (received != sizeof(result) || status != 0) {
+        fprintf(stderr, "A start failed.\n");
+        exit(70);
+    }
+    return result;
+}
+
+// Configuration the way a job's prelude might set it up: names, numbers and
+// strings built by concatenation, with a few long ones.
+static char* makeScript(int declarations) {
+    size_t capacity = 256 + (size_t)declarations * 160;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source, "var prefix = \"service\";\n");
+
+    for (int i = 0; i < declarations; i++) {
+        switch (i % 4) {
+            case 0:
+                length += sprintf(source + length, "var setting%d = prefix + \".option.\" + \"%d\";\n", i, i);
+                break;
+            case 1:
+                length += sprintf(source + length, "var setting%d = %d * 1.5 + 2;\n", i, i);
+                break;
+            case 2:
+                length += sprintf(source + length, "var setting%d = %s;\n", i, i % 8 == 2 ? "true" : "nil");
+                break;
+            case 3:
+                length += sprintf(source + length,
+                    "var setting%d = setting%d + \"=\" + \"a much longer value, as a description or a template "
+                    "would be, so that some strings are bigger than the rest\";\n", i, i - 3);
+                break;
+        }
+    }
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,141 @@
+// Interns one vocabulary of identifiers from 1 to 16 threads at once into the
+// shared string pool, and into the same pool behind a single mutex for
+// comparison. Each run starts from an empty pool: first every thread interns
+// the whole vocabulary from its own starting point, so the threads race to
+// insert the same strings, then they look up random ones that are all there.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "intern.h"
+
+#define VOCABULARY 500000
+#define LOOKUPS 8000000
+#define MAX_THREADS 16
+#define KEY_SIZE 16
+
+typedef struct {
+    int index;
+    int threads;
+    bool locked;
+    bool lookup;
+    uint32_t randomState;
+    uint64_t found;
+} Worker;
+
+static double run(int threads, bool locked, bool lookup);
+static void* work(void* argument);
+static ObjString* intern(Worker* worker, int key);
+static uint32_t nextRandom(uint32_t* state);
+static double now();
+
+static char* keys;
+static int* lengths;
+static uint32_t* hashes;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int main(int argc, const char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+
+    // the keys are hashed up front, so only interning is timed
+    keys = malloc((size_t)VOCABULARY * KEY_SIZE);
+    lengths = malloc(sizeof(int) * VOCABULARY);
+    hashes = malloc(sizeof(uint32_t) * VOCABULARY);
+    for (int i = 0; i < VOCABULARY; i++) {
+        lengths[i] = snprintf(keys + (size_t)i * KEY_SIZE, KEY_SIZE, "name%d", i);
+        hashes[i] = hashString(keys + (size_t)i * KEY_SIZE, lengths[i]);
+    }
+
+    printf("%ld CPUs online, %d identifiers, %d lookups per run\n\n",
+           sysconf(_SC_NPROCESSORS_ONLN), VOCABULARY, LOOKUPS);
+    printf("%7s %17s %17s %17s %17s\n", "", "lock-free", "", "mutex", "");
+    printf("%7s %17s %17s %17s %17s\n", "threads", "intern", "lookup", "intern", "lookup");
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double freeIntern = run(threads, false, false);
+        double freeLookup = run(threads, false, true);
+        double lockedIntern = run(threads, true, false);
+        double lockedLookup = run(threads, true, true);
+        printf("%7d %10.1f Mop/s %10.1f Mop/s %10.1f Mop/s %10.1f Mop/s\n", threads,
+               freeIntern, freeLookup, lockedIntern, lockedLookup);
+    }
+
+    free(keys);
+    free(lengths);
+    free(hashes);
+    return 0;
+}
+
+// Returns millions of operations per second. A lookup run fills the pool
+// before the clock starts.
+static double run(int threads, bool locked, bool lookup) {
+    freeSharedStrings();
+    if (lookup) {
+        for (int i = 0; i < VOCABULARY; i++) {
+            internSharedString(keys + (size_t)i * KEY_SIZE, lengths[i], hashes[i]);
+        }
+    }
+
+    pthread_t ids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){i, threads, locked, lookup, 2463534242u + i, 0};
+        pthread_create(&ids[i], NULL, work, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    if (sharedStringCount() != VOCABULARY) {
+        fprintf(stderr, "the pool has %d strings instead of %d\n", sharedStringCount(), VOCABULARY);
+        exit(1);
+    }
+    double operations = lookup ? LOOKUPS : (double)threads * VOCABULARY;
+    return operations / elapsed / 1e6;
+}
+
+static void* work(void* argument) {
+    Worker* worker = argument;
+    if (worker->lookup) {
+        for (int i = 0; i < LOOKUPS / worker->threads; i++) {
+            int key = (int)(nextRandom(&worker->randomState) % VOCABULARY);
+            worker->found += intern(worker, key)->length;
+        }
+    } else {
+        int offset = (int)((int64_t)VOCABULARY * worker->index / worker->threads);
+        for (int i = 0; i < VOCABULARY; i++) {
+            worker->found += intern(worker, (offset + i) % VOCABULARY)->length;
+        }
+    }
+    return NULL;
+}
+
+static ObjString* intern(Worker* worker, int key) {
+    const char* chars = keys + (size_t)key * KEY_SIZE;
+    if (!worker->locked) {
+        return internSharedString(chars, lengths[key], hashes[key]);
+    }
+    pthread_mutex_lock(&lock);
+    ObjString* string = internSharedString(chars, lengths[key], hashes[key]);
+    pthread_mutex_unlock(&lock);
+    return string;
+}
+
+// xorshift32, so that every build sees the same sequence
+static uint32_t nextRandom(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
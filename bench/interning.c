@@ -0,0 +1,78 @@
+// Interns a million distinct strings and then looks each of them up again, and
+// reports how many heap blocks that took and how fast both passes were.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define STRINGS 1000000
+#define KEY_SIZE 24
+
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : STRINGS;
+
+    initVM(&vm);
+
+    // the keys are made up front, so the timings only cover interning
+    char* keys = malloc((size_t)count * KEY_SIZE);
+    int* lengths = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        lengths[i] = snprintf(keys + (size_t)i * KEY_SIZE, KEY_SIZE, "key:%d", i);
+    }
+
+    // the strings are kept alive as the constants of a chunk that is a root;
+    // the array is sized up front so it doesn't count as an allocation
+    Chunk chunk;
+    initChunk(&chunk);
+    chunk.constants.values = GROW_ARRAY(&vm, Value, NULL, 0, count);
+    chunk.constants.capacity = count;
+    vm.chunk = &chunk;
+
+    uint64_t allocations = vm.gcStats.allocations;
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        ObjString* string = copyString(&vm, keys + (size_t)i * KEY_SIZE, lengths[i]);
+        writeValueArray(&vm, &chunk.constants, OBJ_VAL(string));
+    }
+    double internTime = now() - start;
+    allocations = vm.gcStats.allocations - allocations;
+
+    int found = 0;
+    start = now();
+    for (int i = 0; i < count; i++) {
+        ObjString* string = copyString(&vm, keys + (size_t)i * KEY_SIZE, lengths[i]);
+        found += string == AS_STRING(chunk.constants.values[i]);
+    }
+    double lookupTime = now() - start;
+
+    printf("strings:      %d distinct, %d found again\n", count, found);
+    printf("allocations:  %llu, %.2f per string\n",
+           (unsigned long long)allocations, (double)allocations / count);
+    printf("intern:       %.3f s, %.0f ns/string, %.1f M strings/s\n",
+           internTime, internTime * 1e9 / count, count / internTime / 1e6);
+    printf("lookup:       %.3f s, %.0f ns/string, %.1f M strings/s\n",
+           lookupTime, lookupTime * 1e9 / count, count / lookupTime / 1e6);
+
+    vm.chunk = NULL;
+    freeChunk(&vm, &chunk);
+    free(keys);
+    free(lengths);
+    freeVM(&vm);
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
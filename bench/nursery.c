@@ -0,0 +1,110 @@
+// Runs a string-building workload and reports the allocation rate, collector
+// pauses and peak RSS. CMake builds it twice: bench_nursery with the young
+// generation and bench_heap, which allocates every string on the main heap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+#define STATEMENTS 20000
+#define RUNS 50
+
+static char* makeWorkload(int statements);
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int statements = argc > 1 ? atoi(argv[1]) : STATEMENTS;
+    int runs = argc > 2 ? atoi(argv[2]) : RUNS;
+
+    initVM(&vm);
+
+    char* source = makeWorkload(statements);
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(&vm, source, &chunk)) {
+        fprintf(stderr, "Could not compile the workload.\n");
+        return 65;
+    }
+    free(source);
+
+    // start from a collected heap, so the compiler's garbage doesn't decide
+    // when the first collection happens, and only count what running does
+    vm.chunk = &chunk;
+    collectGarbage(&vm);
+    vm.chunk = NULL;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        if (interpretChunk(&vm, &chunk) != INTERPRET_OK) {
+            fprintf(stderr, "The workload failed.\n");
+            return 70;
+        }
+    }
+    double elapsed = now() - start;
+
+    GcStats* stats = &vm.gcStats;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#ifdef NURSERY
+    printf("heap:             nursery of %d KB + mark-sweep\n", NURSERY_SIZE / 1024);
+#else
+    printf("heap:             mark-sweep only\n");
+#endif
+    printf("run():            %d runs in %.3f s\n", runs, elapsed);
+    printf("allocated:        %.1f MB, %.0f MB/s\n",
+           stats->bytesRequested / 1e6, stats->bytesRequested / 1e6 / elapsed);
+    printf("allocations:      %llu\n", (unsigned long long)stats->allocations);
+    printf("minor pauses:     %llu, mean %.1f us, max %.1f us\n",
+           (unsigned long long)stats->minorCollections,
+           stats->minorCollections > 0 ? stats->minorPauseNs / 1e3 / stats->minorCollections : 0.0,
+           stats->maxMinorPauseNs / 1e3);
+    printf("promoted:         %.1f MB\n", stats->promotedBytes / 1e6);
+    printf("major pauses:     %llu, mean %.1f us, max %.1f us\n",
+           (unsigned long long)stats->majorCollections,
+           stats->majorCollections > 0 ? stats->majorPauseNs / 1e3 / stats->majorCollections : 0.0,
+           stats->maxMajorPauseNs / 1e3);
+    printf("peak RSS:         %ld KB\n", usage.ru_maxrss);
+
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+// Lox has no loops yet, so the loop is unrolled. Most strings are temporaries
+// that are dead by the next statement; a few accumulate in a global that is
+// reset now and then, and some live in block locals.
+static char* makeWorkload(int statements) {
+    size_t capacity = 64 + (size_t)statements * 96;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source, "var tmp = \"\";\nvar acc = \"\";\n");
+
+    for (int i = 0; i < statements; i++) {
+        length += sprintf(source + length, "tmp = \"item\" + \"%d\" + \":\" + \"%d\";\n", i, i % 97);
+        if (i % 8 == 0) {
+            length += sprintf(source + length, "acc = acc + tmp;\n");
+        }
+        if (i % 16 == 0) {
+            length += sprintf(source + length, "{ var a = tmp + tmp; var b = a + \"!\"; }\n");
+        }
+        if (i % 1024 == 0) {
+            length += sprintf(source + length, "acc = \"\";\n");
+        }
+    }
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,150 @@
+// Forks workers from a VM that has run a large prelude, once with its heap
+// frozen and once as it is, and reports how much memory each worker ends up
+// not sharing with the others. Each worker runs a small job and then a full
+// collection, which is what makes an unfrozen heap go private: marking writes
+// to every live object's header and sweeping to the next links between them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "prefork.h"
+#include "vm.h"
+
+#define WORKERS 4
+
+static void runMode(bool frozen, const char* prelude, const char* job);
+static ProcessMemory runWorker(VM* vm, const char* job);
+static char* makePrelude(int declarations);
+
+int main(int argc, const char* argv[]) {
+    int declarations = argc > 1 ? atoi(argv[1]) : 100000;
+    char* prelude = makePrelude(declarations);
+    const char* job =
+        "var total = 0;\n"
+        "var line = \"\";\n"
+        "{ var i = setting1 + 1; total = i * 2; line = setting0 + \":\" + \"job\"; }\n";
+
+    if (processMemory().resident < 0) {
+        fprintf(stderr, "/proc/self/smaps_rollup can't be read here.\n");
+        return 1;
+    }
+
+    printf("%d declarations in the prelude, %d workers, averages per worker\n\n", declarations, WORKERS);
+    printf("%-10s %14s %14s %14s\n", "heap", "parent", "private", "shared");
+    // each mode runs in a process of its own, so both start from the same state
+    for (int frozen = 0; frozen <= 1; frozen++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            runMode(frozen, prelude, job);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    free(prelude);
+    return 0;
+}
+
+static void runMode(bool frozen, const char* prelude, const char* job) {
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+    initVM(vm);
+    if (interpret(vm, prelude) != INTERPRET_OK) {
+        exit(70);
+    }
+    if (frozen) {
+        freezeHeap(vm);
+    } else {
+        collectGarbage(vm);
+    }
+    ProcessMemory parent = processMemory();
+
+    // the workers stay alive until all of them have measured themselves, since
+    // a page only counts as shared while another process still maps it; they
+    // wait for the parent to close the release pipe
+    int release[2];
+    if (pipe(release) != 0) {
+        exit(1);
+    }
+    int channels[WORKERS];
+    pid_t pids[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        int channel[2];
+        if (pipe(channel) != 0) {
+            exit(1);
+        }
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(release[1]);
+            ProcessMemory memory = runWorker(vm, job);
+            write(channel[1], &memory, sizeof(memory));
+            char byte;
+            read(release[0], &byte, 1);
+            _exit(0);
+        }
+        close(channel[1]);
+        channels[i] = channel[0];
+    }
+    close(release[0]);
+
+    long totalPrivate = 0;
+    long totalShared = 0;
+    for (int i = 0; i < WORKERS; i++) {
+        ProcessMemory memory;
+        if (read(channels[i], &memory, sizeof(memory)) != sizeof(memory)) {
+            exit(70);
+        }
+        totalPrivate += memory.private;
+        totalShared += memory.shared;
+    }
+    close(release[1]);
+    for (int i = 0; i < WORKERS; i++) {
+        close(channels[i]);
+        waitpid(pids[i], NULL, 0);
+    }
+
+    printf("%-10s %11ld KB %11ld KB %11ld KB\n", frozen ? "frozen" : "unfrozen",
+           parent.resident, totalPrivate / WORKERS, totalShared / WORKERS);
+}
+
+// Runs the job and a full collection, and measures what that left private.
+static ProcessMemory runWorker(VM* vm, const char* job) {
+    if (interpret(vm, job) != INTERPRET_OK) {
+        _exit(70);
+    }
+    collectGarbage(vm);
+    return processMemory();
+}
+
+static char* makePrelude(int declarations) {
+    size_t capacity = 256 + (size_t)declarations * 160;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source, "var prefix = \"service\";\n");
+
+    for (int i = 0; i < declarations; i++) {
+        switch (i % 4) {
+            case 0:
+                length += sprintf(source + length, "var setting%d = prefix + \".option.\" + \"%d\";\n", i, i);
+                break;
+            case 1:
+                length += sprintf(source + length, "var setting%d = %d * 1.5 + 2;\n", i, i);
+                break;
+            case 2:
+                length += sprintf(source + length, "var setting%d = %s;\n", i, i % 8 == 2 ? "true" : "nil");
+                break;
+            case 3:
+                length += sprintf(source + length,
+                    "var setting%d = setting%d + \"=\" + \"a much longer value, as a description or a template "
+                    "would be, so that some strings are bigger than the rest\";\n", i, i - 3);
+                break;
+        }
+    }
+    return source;
+}
@@ -0,0 +1,84 @@
+// Builds a long string from small fragments with s = s + fragment, then
+// compares it once so that it has to be flattened. CMake builds it twice:
+// bench_rope with ropes and bench_flat, which copies on every concatenation
+// and needs tens of seconds for the default 1 MB.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+
+#define TARGET_KB 1024
+#define FRAGMENT_SIZE 64
+
+static char* makeWorkload(int pieces, int fragmentSize);
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int targetKb = argc > 1 ? atoi(argv[1]) : TARGET_KB;
+    int fragmentSize = argc > 2 ? atoi(argv[2]) : FRAGMENT_SIZE;
+    int pieces = targetKb * 1024 / fragmentSize;
+
+    initVM(&vm);
+
+    char* source = makeWorkload(pieces, fragmentSize);
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(&vm, source, &chunk)) {
+        fprintf(stderr, "Could not compile the workload.\n");
+        return 65;
+    }
+    free(source);
+
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    double start = now();
+    if (interpretChunk(&vm, &chunk) != INTERPRET_OK) {
+        fprintf(stderr, "The workload failed.\n");
+        return 70;
+    }
+    double elapsed = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#ifdef ROPES
+    printf("concatenation: ropes from %d characters\n", ROPE_MIN_LENGTH);
+#else
+    printf("concatenation: copying\n");
+#endif
+    printf("string:        %d KB from %d fragments of %d characters\n", targetKb, pieces, fragmentSize);
+    printf("run():         %.3f s, %.0f ns/fragment\n", elapsed, elapsed * 1e9 / pieces);
+    printf("allocated:     %.1f MB\n", vm.gcStats.bytesRequested / 1e6);
+    printf("peak RSS:      %ld KB\n", usage.ru_maxrss);
+
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+// Lox has no loops yet, so the loop is unrolled. Every fragment is distinct,
+// the way lines of generated output usually are.
+static char* makeWorkload(int pieces, int fragmentSize) {
+    size_t capacity = 128 + (size_t)pieces * (fragmentSize + 32);
+    char* source = malloc(capacity);
+    size_t length = sprintf(source, "var s = \"\";\n");
+
+    for (int i = 0; i < pieces; i++) {
+        length += sprintf(source + length, "s = s + \"%0*d\";\n", fragmentSize, i);
+    }
+    length += sprintf(source + length, "var flattened = s == \"\";\n");
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,326 @@
+// Starts a --serve daemon in a child process and sends it the same script from
+// 1 to 16 client threads at once, reporting the requests per second, the
+// median and 99th percentile latency and the server's resident memory after the
+// run. A last run sends a different script every time, with names and strings
+// of its own, which is what shows whether the server holds on to anything
+// between requests. For comparison it runs the script in process with a fresh
+// VM each time and with one VM reset between runs, and, given the path to the
+// clox command, as one clox process per request.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "intern.h"
+#include "serve.h"
+#include "vm.h"
+
+#define STATEMENTS 200
+#define REQUESTS 4000
+#define SERVER_WORKERS 4
+#define MAX_CLIENTS 16
+
+typedef struct {
+    const char* socketPath;
+    const char* source;
+    int requests;
+    double* latencies; // seconds, one per request
+    int id;
+    bool distinct; // every request gets a global and a string no other one has
+    bool failed;
+} Client;
+
+typedef double (*RunFn)(const char* source, void* context);
+
+static void startServer(const char* socketPath);
+static void* sendRequests(void* argument);
+static void runClients(const char* socketPath, const char* source, int clients, bool distinct, pid_t server, double* latencies);
+static void runLocally(const char* name, RunFn run, const char* source, void* context, int requests, double* latencies);
+static double runFresh(const char* source, void* context);
+static double runReset(const char* source, void* context);
+static double runProcess(const char* source, void* context);
+static void report(const char* name, int requests, double elapsed, double* latencies);
+static long residentKilobytes(pid_t pid);
+static int compareDoubles(const void* a, const void* b);
+static char* makeScript(int statements);
+static double now();
+
+extern char** environ;
+
+static FILE* discard; // /dev/null, for what the scripts print
+static atomic_int distinctSent; // numbers the distinct requests, so none repeats
+
+int main(int argc, const char* argv[]) {
+    const char* clox = argc > 1 ? argv[1] : NULL;
+    char socketPath[64];
+    snprintf(socketPath, sizeof(socketPath), "/tmp/clox-bench-%d.sock", (int)getpid());
+
+    char* source = makeScript(STATEMENTS);
+    discard = fopen("/dev/null", "w");
+    double* latencies = malloc(sizeof(double) * REQUESTS);
+    if (latencies == NULL) {
+        exit(1);
+    }
+
+    printf("%ld CPUs online, %d statements per script, %d requests per run, %d server workers\n\n",
+           sysconf(_SC_NPROCESSORS_ONLN), STATEMENTS, REQUESTS, SERVER_WORKERS);
+    printf("%-20s %12s %10s %10s %12s\n", "", "requests", "p50", "p99", "server RSS");
+
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+    runLocally("fresh VM", runFresh, source, vm, REQUESTS, latencies);
+    initVM(vm);
+    runLocally("reset VM", runReset, source, vm, REQUESTS, latencies);
+    freeVM(vm);
+    free(vm);
+
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        startServer(socketPath);
+    }
+    for (int clients = 1; clients <= MAX_CLIENTS; clients *= 4) {
+        runClients(socketPath, source, clients, false, server, latencies);
+    }
+    for (int run = 0; run < 3; run++) {
+        runClients(socketPath, source, SERVER_WORKERS, true, server, latencies);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    if (clox != NULL) {
+        char scriptPath[64];
+        snprintf(scriptPath, sizeof(scriptPath), "/tmp/clox-bench-%d.lox", (int)getpid());
+        FILE* file = fopen(scriptPath, "w");
+        fputs(source, file);
+        fclose(file);
+
+        const char* command[] = { clox, scriptPath };
+        runLocally("process per request", runProcess, source, command, REQUESTS / 10, latencies);
+        unlink(scriptPath);
+    }
+
+    fclose(discard);
+    free(latencies);
+    free(source);
+    freeSharedStrings();
+    return 0;
+}
+
+// Runs in the child: serves until the parent sends SIGTERM, with the server's
+// own messages out of the way.
+static void startServer(const char* socketPath) {
+    freopen("/dev/null", "w", stderr);
+    int status = serve(socketPath, SERVER_WORKERS, 1);
+    freeSharedStrings();
+    exit(status);
+}
+
+static void runClients(const char* socketPath, const char* source, int clients, bool distinct, pid_t server, double* latencies) {
+    // wait for the server to come up
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    for (;;) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool up = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+        close(probe);
+        if (up) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    pthread_t ids[MAX_CLIENTS];
+    Client workers[MAX_CLIENTS];
+    int perClient = REQUESTS / clients;
+    double start = now();
+    for (int i = 0; i < clients; i++) {
+        workers[i] = (Client){socketPath, source, perClient, latencies + i * perClient, i, distinct, false};
+        pthread_create(&ids[i], NULL, sendRequests, &workers[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    for (int i = 0; i < clients; i++) {
+        if (workers[i].failed) {
+            fprintf(stderr, "A request failed.\n");
+            exit(70);
+        }
+    }
+
+    char name[32];
+    if (distinct) {
+        snprintf(name, sizeof(name), "distinct, %d clients", clients);
+    } else {
+        snprintf(name, sizeof(name), "served, %d client%s", clients, clients == 1 ? "" : "s");
+    }
+    report(name, perClient * clients, elapsed, latencies);
+    printf(" %9ld KB\n", residentKilobytes(server));
+}
+
+// Each client sends its requests one after the other, over a new connection
+// each time, and throws away the output.
+static void* sendRequests(void* argument) {
+    Client* client = argument;
+    size_t sourceLength = strlen(client->source);
+    char* distinct = malloc(sourceLength + 128);
+    if (distinct == NULL) {
+        exit(1);
+    }
+    memcpy(distinct, client->source, sourceLength);
+
+    for (int i = 0; i < client->requests; i++) {
+        const char* source = client->source;
+        size_t length = sourceLength;
+        if (client->distinct) {
+            int request = atomic_fetch_add(&distinctSent, 1);
+            length += sprintf(distinct + sourceLength,
+                "var request%d = \"request %d from client %d\";\n", request, request, client->id);
+            source = distinct;
+        }
+
+        double start = now();
+        FILE* script = fmemopen((void*)source, length, "r");
+        int status = sendScript(client->socketPath, script, discard, stderr);
+        fclose(script);
+        client->latencies[i] = now() - start;
+        if (status != 0) {
+            client->failed = true;
+            break;
+        }
+    }
+
+    free(distinct);
+    return NULL;
+}
+
+static void runLocally(const char* name, RunFn run, const char* source, void* context, int requests, double* latencies) {
+    double start = now();
+    for (int i = 0; i < requests; i++) {
+        latencies[i] = run(source, context);
+    }
+    report(name, requests, now() - start, latencies);
+    printf("\n");
+}
+
+static double runFresh(const char* source, void* context) {
+    VM* vm = context;
+    double start = now();
+    initVM(vm);
+    vm->output = discard;
+    InterpretResult result = interpret(vm, source);
+    freeVM(vm);
+    if (result != INTERPRET_OK) {
+        exit(70);
+    }
+    return now() - start;
+}
+
+static double runReset(const char* source, void* context) {
+    VM* vm = context;
+    double start = now();
+    vm->output = discard;
+    InterpretResult result = interpret(vm, source);
+    resetVM(vm);
+    if (result != INTERPRET_OK) {
+        exit(70);
+    }
+    return now() - start;
+}
+
+static double runProcess(const char* source, void* context) {
+    (void)source;
+    const char** command = context;
+    char* arguments[] = { (char*)command[0], (char*)command[1], NULL };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    double start = now();
+    pid_t pid;
+    int status = -1;
+    if (posix_spawn(&pid, command[0], &actions, NULL, arguments, environ) == 0) {
+        waitpid(pid, &status, 0);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (status != 0) {
+        fprintf(stderr, "\"%s\" failed.\n", command[0]);
+        exit(70);
+    }
+    return now() - start;
+}
+
+static void report(const char* name, int requests, double elapsed, double* latencies) {
+    qsort(latencies, requests, sizeof(double), compareDoubles);
+    double p50 = latencies[requests / 2];
+    double p99 = latencies[requests * 99 / 100];
+    printf("%-20s %10.0f/s %8.1f us %8.1f us", name, requests / elapsed, p50 * 1e6, p99 * 1e6);
+}
+
+// Reads VmRSS from /proc, or returns -1 where it can't.
+static long residentKilobytes(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    long kilobytes = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kilobytes) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kilobytes;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// A script like the ones a server would run per request: a few globals,
+// locals in blocks, arithmetic and string building, printing only the result.
+static char* makeScript(int statements) {
+    size_t capacity = 256 + (size_t)statements * 128;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source,
+        "var total = 0;\n"
+        "var name = \"worker\";\n"
+        "var line = \"\";\n");
+
+    for (int i = 0; i < statements; i++) {
+        length += sprintf(source + length,
+            "{ var x = total + %d; var y = x * 2 - 1; total = y / 2; "
+            "line = name + \" #\" + \"%d\" + \": \" + \"done\"; }\n", i, i);
+    }
+    sprintf(source + length, "print line;\n");
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
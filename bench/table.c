@@ -0,0 +1,167 @@
+// Fills tables of 1K to 10M string keys and reports how long the probe
+// sequences are, how fast keys are inserted and looked up, and how much memory
+// each key takes. CMake builds it with SSE2 probing (bench_table) and with the
+// portable loop (bench_table_scalar).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define MAX_KEYS 10000000
+#define MISSES 1000000
+
+static void measureSize(Chunk* chunk, int count);
+static void shuffle(int* order, int count);
+static uint32_t nextRandom();
+static double now();
+
+static VM vm;
+static uint32_t randomState = 2463534242u;
+static volatile uint64_t sink;
+
+int main(int argc, const char* argv[]) {
+    int maxKeys = argc > 1 ? atoi(argv[1]) : MAX_KEYS;
+
+    initVM(&vm);
+
+    // the keys are kept alive as the constants of a chunk that is a root
+    Chunk chunk;
+    initChunk(&chunk);
+    vm.chunk = &chunk;
+
+#if defined(__SSE2__) && !defined(TABLE_SCALAR)
+    printf("probing: SSE2, %d slots per group\n\n", TABLE_GROUP_SIZE);
+#else
+    printf("probing: portable loop, %d slots per group\n\n", TABLE_GROUP_SIZE);
+#endif
+    printf("%9s %7s %10s %10s %10s %10s %10s %10s\n",
+           "keys", "probes", "B/key", "insert", "get", "intern", "miss", "delete");
+    for (int count = 1000; count <= maxKeys; count *= 10) {
+        measureSize(&chunk, count);
+    }
+
+    vm.chunk = NULL;
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+// Times, per key: tableSet() into a fresh table, tableGet() of every key in a
+// random order, tableFindString() of every key in the interning table, and of
+// keys that aren't in it, and finally tableDelete() of every key.
+static void measureSize(Chunk* chunk, int count) {
+    chunk->constants.values = GROW_ARRAY(&vm, Value, chunk->constants.values, chunk->constants.capacity, count);
+    chunk->constants.capacity = count;
+    chunk->constants.count = 0;
+
+    char key[32];
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(key, sizeof(key), "key:%d", i);
+        writeValueArray(&vm, &chunk->constants, OBJ_VAL(copyString(&vm, key, length)));
+    }
+    Value* keys = chunk->constants.values;
+
+    int* order = malloc(sizeof(int) * count);
+    shuffle(order, count);
+
+    // the misses are hashed up front, so only the lookups are timed
+    int misses = count < MISSES ? count : MISSES;
+    char* missKeys = malloc((size_t)misses * 16);
+    int* missLengths = malloc(sizeof(int) * misses);
+    uint32_t* missHashes = malloc(sizeof(uint32_t) * misses);
+    for (int i = 0; i < misses; i++) {
+        missLengths[i] = snprintf(missKeys + (size_t)i * 16, 16, "miss:%d", i);
+        missHashes[i] = hashString(missKeys + (size_t)i * 16, missLengths[i]);
+    }
+
+    Table table;
+    initTable(&table);
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        tableSet(&vm, &table, AS_STRING(keys[order[i]]), NUMBER_VAL(i));
+    }
+    double insertTime = now() - start;
+    double probes = tableProbeLength(&table);
+    double bytesPerKey = (double)table.slots.capacity
+        * (sizeof(uint8_t) + sizeof(Entry)) / count;
+
+    shuffle(order, count);
+    uint64_t total = 0;
+    start = now();
+    for (int i = 0; i < count; i++) {
+        Value value;
+        total += tableGet(&table, AS_STRING(keys[order[i]]), &value);
+    }
+    double getTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        ObjString* string = AS_STRING(keys[order[i]]);
+        total += tableFindString(&vm.strings, string->chars, string->length, string->hash) == string;
+    }
+    double internTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < misses; i++) {
+        total += tableFindString(&vm.strings, missKeys + (size_t)i * 16, missLengths[i], missHashes[i]) == NULL;
+    }
+    double missTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+        total += tableDelete(&vm, &table, AS_STRING(keys[order[i]]));
+    }
+    double deleteTime = now() - start;
+    sink = total;
+
+    printf("%9d %7.2f %10.1f %7.1f ns %7.1f ns %7.1f ns %7.1f ns %7.1f ns\n",
+           count, probes, bytesPerKey,
+           insertTime * 1e9 / count, getTime * 1e9 / count, internTime * 1e9 / count,
+           missTime * 1e9 / misses, deleteTime * 1e9 / count);
+
+    freeTable(&vm, &table);
+    free(order);
+    free(missKeys);
+    free(missLengths);
+    free(missHashes);
+
+    // let the next collection take this size's keys
+    chunk->constants.count = 0;
+    collectGarbage(&vm);
+}
+
+// a random permutation of 0 to count - 1, so lookups don't follow the order
+// the keys were allocated in
+static void shuffle(int* order, int count) {
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (int i = count - 1; i > 0; i--) {
+        int j = (int)(nextRandom() % (uint32_t)(i + 1));
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+}
+
+// xorshift32, so that every build sees the same sequence
+static uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
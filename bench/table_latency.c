@@ -0,0 +1,101 @@
+// Grows one table to millions of keys and reports the distribution of the time
+// single tableSet() calls take, where the resizes show up as the tail. CMake
+// builds it with incremental resizing (bench_table_latency) and with every
+// resize done by the write that starts it (bench_table_rehash).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEYS 4000000
+
+static int compareLatencies(const void* a, const void* b);
+static uint64_t percentile(uint32_t* sorted, int count, double fraction);
+static uint64_t nowNs();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : KEYS;
+
+    initVM(&vm);
+
+    // the keys are kept alive as the constants of a chunk that is a root
+    Chunk chunk;
+    initChunk(&chunk);
+    chunk.constants.values = GROW_ARRAY(&vm, Value, NULL, 0, count);
+    chunk.constants.capacity = count;
+    vm.chunk = &chunk;
+
+    char key[32];
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(key, sizeof(key), "global%d", i);
+        writeValueArray(&vm, &chunk.constants, OBJ_VAL(copyString(&vm, key, length)));
+    }
+
+    // only the table is timed, not the collections its allocations could start
+    vm.nextGC = SIZE_MAX;
+
+    uint32_t* latencies = malloc(sizeof(uint32_t) * count);
+    Table table;
+    initTable(&table);
+    uint64_t start = nowNs();
+    for (int i = 0; i < count; i++) {
+        uint64_t before = nowNs();
+        tableSet(&vm, &table, AS_STRING(chunk.constants.values[i]), NUMBER_VAL(i));
+        uint64_t elapsed = nowNs() - before;
+        latencies[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+    }
+    uint64_t total = nowNs() - start;
+
+    int slow = 0;
+    for (int i = 0; i < count; i++) {
+        slow += latencies[i] >= 1000000;
+    }
+    qsort(latencies, count, sizeof(uint32_t), compareLatencies);
+
+#if TABLE_MIGRATE_GROUPS > 1000000
+    printf("resizing:  all at once\n");
+#else
+    printf("resizing:  incremental, %d groups per write\n", TABLE_MIGRATE_GROUPS);
+#endif
+    printf("keys:      %d, %d slots at the end\n", count, table.slots.capacity);
+    printf("total:     %.3f s, %.0f ns/insert (with the clock reads)\n", total / 1e9, (double)total / count);
+    printf("p50:       %llu ns\n", (unsigned long long)percentile(latencies, count, 0.50));
+    printf("p99:       %llu ns\n", (unsigned long long)percentile(latencies, count, 0.99));
+    printf("p99.9:     %llu ns\n", (unsigned long long)percentile(latencies, count, 0.999));
+    printf("p99.99:    %llu ns\n", (unsigned long long)percentile(latencies, count, 0.9999));
+    printf("max:       %.3f ms\n", latencies[count - 1] / 1e6);
+    printf("over 1 ms: %d inserts\n", slow);
+
+    free(latencies);
+    freeTable(&vm, &table);
+    vm.chunk = NULL;
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
+
+static int compareLatencies(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return (left > right) - (left < right);
+}
+
+static uint64_t percentile(uint32_t* sorted, int count, double fraction) {
+    int index = (int)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
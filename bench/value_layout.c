@@ -0,0 +1,93 @@
+// Compares the memory footprint and run() throughput of the value layout
+// this binary was built with. CMake builds it twice (bench_value_tagged and
+// bench_value_nanbox) so the two layouts can be run side by side.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "table.h"
+#include "vm.h"
+
+#define STATEMENTS 30
+#define RUNS 200000
+
+static char* makeWorkload();
+static double now();
+
+static VM vm;
+
+int main(int argc, const char* argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : RUNS;
+
+    initVM(&vm);
+
+    char* source = makeWorkload();
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(&vm, source, &chunk)) {
+        fprintf(stderr, "Could not compile the workload.\n");
+        return 65;
+    }
+
+#ifdef NAN_BOXING
+    printf("layout:          nan-boxed\n");
+#else
+    printf("layout:          tagged union\n");
+#endif
+    printf("sizeof(Value):   %zu bytes\n", sizeof(Value));
+    printf("sizeof(Entry):   %zu bytes\n", sizeof(Entry));
+    printf("stack:           %zu bytes (%d slots)\n", sizeof(vm.stack), STACK_MAX);
+    printf("constant pool:   %zu bytes (%d constants, %d before deduplication)\n",
+           chunk.constants.capacity * sizeof(Value), chunk.constants.count, chunk.constantRequests);
+
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        if (interpretChunk(&vm, &chunk) != INTERPRET_OK) {
+            fprintf(stderr, "The workload failed.\n");
+            return 70;
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("globals:         %zu bytes (%d slots)\n",
+           vm.globalValues.capacity * sizeof(Value), vm.globalValues.count);
+    printf("global slots:    %zu bytes (%d entries)\n",
+           vm.globalSlots.slots.capacity * (sizeof(Entry) + 1), vm.globalSlots.count);
+    printf("strings table:   %zu bytes (%d entries)\n",
+           vm.strings.slots.capacity * (sizeof(Entry) + 1), vm.strings.count);
+    printf("run():           %d runs of %d bytes in %.3f s, %.0f ns/run, %.1f MB/s of bytecode\n",
+           runs, chunk.count, elapsed, elapsed * 1e9 / runs,
+           (double)chunk.count * runs / elapsed / 1e6);
+
+    freeChunk(&vm, &chunk);
+    free(source);
+    freeVM(&vm);
+    return 0;
+}
+
+// Builds an arithmetic-heavy script over a handful of globals. It stays below
+// the per-chunk constant limit so it compiles as a single chunk.
+static char* makeWorkload() {
+    size_t capacity = 128 + STATEMENTS * 64;
+    char* source = malloc(capacity);
+    int length = sprintf(source, "var a = 1; var b = 2; var c = 3; var d = 4;\n");
+
+    const char* names = "abcd";
+    for (int i = 0; i < STATEMENTS; i++) {
+        char x = names[i % 4];
+        char y = names[(i + 1) % 4];
+        char z = names[(i + 2) % 4];
+        length += sprintf(source + length, "%c = %c * 0.5 + %c - -%d;\n", x, y, z, i);
+    }
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
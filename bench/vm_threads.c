@@ -0,0 +1,123 @@
+// Runs one VM per thread, from 1 to 32 threads, each compiling and running the
+// same script over and over, and reports how many scripts all of them get
+// through per second. The VMs share nothing but the pool of shared strings, so
+// the aggregate should grow with the threads until the cores run out.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "intern.h"
+#include "vm.h"
+
+#define STATEMENTS 200
+#define SCRIPTS_PER_THREAD 400
+#define MAX_THREADS 32
+
+typedef struct {
+    const char* source;
+    int scripts;
+    bool failed;
+} Worker;
+
+static double run(int threads, const char* source, int scripts);
+static void* work(void* argument);
+static char* makeScript(int statements);
+static double now();
+
+int main(int argc, const char* argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+    int scripts = argc > 2 ? atoi(argv[2]) : SCRIPTS_PER_THREAD;
+    if (maxThreads > MAX_THREADS) {
+        maxThreads = MAX_THREADS;
+    }
+
+    char* source = makeScript(STATEMENTS);
+    printf("%ld CPUs online, %d statements per script, %d scripts per thread\n\n",
+           sysconf(_SC_NPROCESSORS_ONLN), STATEMENTS, scripts);
+    printf("%7s %16s %16s %8s\n", "threads", "aggregate", "per thread", "speedup");
+
+    double single = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double rate = run(threads, source, scripts);
+        if (threads == 1) {
+            single = rate;
+        }
+        printf("%7d %10.0f /s %11.0f /s %7.2fx\n", threads, rate, rate / threads, rate / single);
+    }
+
+    free(source);
+    freeSharedStrings();
+    return 0;
+}
+
+// Returns the scripts all threads ran per second, counting from when the
+// first thread starts to when the last one finishes.
+static double run(int threads, const char* source, int scripts) {
+    pthread_t ids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){source, scripts, false};
+        pthread_create(&ids[i], NULL, work, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    for (int i = 0; i < threads; i++) {
+        if (workers[i].failed) {
+            fprintf(stderr, "The script failed.\n");
+            exit(70);
+        }
+    }
+    return (double)threads * scripts / elapsed;
+}
+
+// Each thread has a VM of its own, with its own heap, allocator and globals.
+static void* work(void* argument) {
+    Worker* worker = argument;
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+    initVM(vm);
+
+    for (int i = 0; i < worker->scripts; i++) {
+        if (interpret(vm, worker->source) != INTERPRET_OK) {
+            worker->failed = true;
+            break;
+        }
+    }
+
+    freeVM(vm);
+    free(vm);
+    return NULL;
+}
+
+// A script like the ones a server would run per request: a few globals,
+// locals in blocks, arithmetic and string building, without printing.
+static char* makeScript(int statements) {
+    size_t capacity = 256 + (size_t)statements * 128;
+    char* source = malloc(capacity);
+    size_t length = sprintf(source,
+        "var total = 0;\n"
+        "var name = \"worker\";\n"
+        "var line = \"\";\n");
+
+    for (int i = 0; i < statements; i++) {
+        length += sprintf(source + length,
+            "{ var x = total + %d; var y = x * 2 - 1; total = y / 2; "
+            "line = name + \" #\" + \"%d\" + \": \" + \"done\"; }\n", i, i);
+    }
+    return source;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE // for mremap()
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+static void* checked(void* pointer);
+
+#ifdef SLAB_ALLOCATOR
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Blocks up to SMALL_MAX bytes are rounded up to a size class: multiples of 16
+// up to 128 bytes, then four classes per doubling. Each class hands out blocks
+// from its own slabs and keeps the freed ones on a free list, so objects of
+// similar sizes are packed together and a freed block is reused by the next
+// allocation of its class. Slabs are only given back to the system when the
+// allocator is freed.
+#define SMALL_MAX 2048
+#define SLAB_SIZE (64 * 1024)
+
+// Blocks from LARGE_MIN bytes up get their own mapping. Up to
+// MAPPING_CACHE_SIZE freed mappings are kept for reuse, so a program that keeps
+// building big arrays doesn't fault in fresh pages for every one of them; the
+// rest go back to the system. The sizes in between go to malloc.
+#define LARGE_MIN (256 * 1024)
+
+static void* allocateBlock(Allocator* allocator, size_t size);
+static void freeBlock(Allocator* allocator, void* pointer, size_t size);
+static int classIndex(size_t size);
+static size_t classSize(int index);
+static void* allocateSmall(Allocator* allocator, int index);
+static void* mapBlock(Allocator* allocator, size_t size);
+static void unmapBlock(Allocator* allocator, void* pointer, size_t size);
+static void* remapBlock(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize);
+static size_t mappingSize(Allocator* allocator, size_t size);
+
+void initAllocator(Allocator* allocator) {
+    memset(allocator, 0, sizeof(Allocator));
+    allocator->pageSize = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Gives every slab and cached mapping back to the system. The blocks handed
+// out must not be used any more; the big ones have to be freed first.
+void freeAllocator(Allocator* allocator) {
+    Slab* slab = allocator->slabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        munmap(slab, SLAB_SIZE);
+        slab = next;
+    }
+    for (int i = 0; i < allocator->mappingCacheCount; i++) {
+        munmap(allocator->mappingCache[i].start, allocator->mappingCache[i].size);
+    }
+    initAllocator(allocator);
+}
+
+// Forgets the free blocks and the untouched rest of every slab, so that the
+// blocks allocated from now on come from new slabs instead of sharing pages
+// with the ones allocated so far. What is forgotten is only given back by
+// freeAllocator().
+void sealAllocator(Allocator* allocator) {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        allocator->classes[i].freeList = NULL;
+        allocator->classes[i].slabTop = NULL;
+        allocator->classes[i].slabEnd = NULL;
+    }
+}
+
+void* reallocateBlock(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize == 0) {
+        freeBlock(allocator, pointer, oldSize);
+        return NULL;
+    }
+    if (pointer == NULL) {
+        return allocateBlock(allocator, newSize);
+    }
+
+    if (oldSize <= SMALL_MAX && newSize <= SMALL_MAX) {
+        if (classIndex(oldSize) == classIndex(newSize)) {
+            return pointer;
+        }
+    } else if (oldSize >= LARGE_MIN && newSize >= LARGE_MIN) {
+        return remapBlock(allocator, pointer, oldSize, newSize);
+    } else if (oldSize > SMALL_MAX && oldSize < LARGE_MIN
+               && newSize > SMALL_MAX && newSize < LARGE_MIN) {
+        return checked(realloc(pointer, newSize));
+    }
+
+    // the block moves to another kind of storage
+    void* result = allocateBlock(allocator, newSize);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    freeBlock(allocator, pointer, oldSize);
+    return result;
+}
+
+static void* allocateBlock(Allocator* allocator, size_t size) {
+    if (size <= SMALL_MAX) {
+        return allocateSmall(allocator, classIndex(size));
+    }
+    if (size >= LARGE_MIN) {
+        return mapBlock(allocator, size);
+    }
+    return checked(malloc(size));
+}
+
+static void freeBlock(Allocator* allocator, void* pointer, size_t size) {
+    if (pointer == NULL) {
+        return;
+    }
+
+    if (size <= SMALL_MAX) {
+        FreeBlock* block = (FreeBlock*)pointer;
+        SizeClass* sizeClass = &allocator->classes[classIndex(size)];
+        block->next = sizeClass->freeList;
+        sizeClass->freeList = block;
+    } else if (size >= LARGE_MIN) {
+        unmapBlock(allocator, pointer, size);
+    } else {
+        free(pointer);
+    }
+}
+
+static int classIndex(size_t size) {
+    if (size <= 128) {
+        return (int)((size - 1) / 16);
+    }
+
+    // the highest set bit of size - 1 picks the doubling, the two bits below
+    // it the class within the doubling
+    size_t bits = size - 1;
+    int highest = 7;
+    while ((bits >> (highest + 1)) != 0) {
+        highest++;
+    }
+    return 8 + (highest - 7) * 4 + (int)((bits >> (highest - 2)) & 3);
+}
+
+static size_t classSize(int index) {
+    if (index < 8) {
+        return (size_t)(index + 1) * 16;
+    }
+    int step = index - 8;
+    return (size_t)(5 + step % 4) << (5 + step / 4);
+}
+
+static void* allocateSmall(Allocator* allocator, int index) {
+    SizeClass* sizeClass = &allocator->classes[index];
+    if (sizeClass->freeList != NULL) {
+        FreeBlock* block = sizeClass->freeList;
+        sizeClass->freeList = block->next;
+        return block;
+    }
+
+    size_t size = classSize(index);
+    if (sizeClass->slabTop + size > sizeClass->slabEnd) {
+        // the tail of the old slab that is too small for a block is left unused,
+        // and the first block of the new one links it to the others
+        uint8_t* slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            exit(1);
+        }
+        ((Slab*)slab)->next = allocator->slabs;
+        allocator->slabs = (Slab*)slab;
+        sizeClass->slabTop = slab + size;
+        sizeClass->slabEnd = slab + SLAB_SIZE;
+    }
+
+    void* block = sizeClass->slabTop;
+    sizeClass->slabTop += size;
+    return block;
+}
+
+static void* mapBlock(Allocator* allocator, size_t size) {
+    size = mappingSize(allocator, size);
+
+    // the smallest cached mapping that is big enough, with its tail unmapped
+    Mapping* cache = allocator->mappingCache;
+    int best = -1;
+    for (int i = 0; i < allocator->mappingCacheCount; i++) {
+        if (cache[i].size >= size && (best < 0 || cache[i].size < cache[best].size)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        Mapping mapping = cache[best];
+        cache[best] = cache[--allocator->mappingCacheCount];
+        if (mapping.size > size) {
+            munmap((uint8_t*)mapping.start + size, mapping.size - size);
+        }
+        return mapping.start;
+    }
+
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        exit(1);
+    }
+#if defined(HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    // only a hint: the kernel backs the aligned 2 MB stretches with huge pages
+    // when it can spare them
+    madvise(block, size, MADV_HUGEPAGE);
+#endif
+    return block;
+}
+
+static void unmapBlock(Allocator* allocator, void* pointer, size_t size) {
+    size = mappingSize(allocator, size);
+    if (allocator->mappingCacheCount < MAPPING_CACHE_SIZE) {
+        Mapping* mapping = &allocator->mappingCache[allocator->mappingCacheCount++];
+        mapping->start = pointer;
+        mapping->size = size;
+        return;
+    }
+    munmap(pointer, size);
+}
+
+static void* remapBlock(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize) {
+    if (mappingSize(allocator, oldSize) == mappingSize(allocator, newSize)) {
+        return pointer;
+    }
+
+#ifdef __linux__
+    // the kernel moves the pages instead of copying them, and the new mapping
+    // keeps the huge page advice
+    void* block = mremap(pointer, mappingSize(allocator, oldSize), mappingSize(allocator, newSize), MREMAP_MAYMOVE);
+    if (block == MAP_FAILED) {
+        exit(1);
+    }
+    return block;
+#else
+    void* block = mapBlock(allocator, newSize);
+    memcpy(block, pointer, oldSize < newSize ? oldSize : newSize);
+    unmapBlock(allocator, pointer, oldSize);
+    return block;
+#endif
+}
+
+static size_t mappingSize(Allocator* allocator, size_t size) {
+    return (size + allocator->pageSize - 1) & ~(allocator->pageSize - 1);
+}
+
+#else
+
+void initAllocator(Allocator* allocator) {
+    allocator->unused = 0;
+}
+
+void freeAllocator(Allocator* allocator) {
+    (void)allocator;
+}
+
+void sealAllocator(Allocator* allocator) {
+    (void)allocator;
+}
+
+void* reallocateBlock(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize) {
+    (void)allocator;
+    (void)oldSize;
+    if (newSize == 0) {
+        free(pointer);
+        return NULL;
+    }
+    return checked(realloc(pointer, newSize));
+}
+
+#endif
+
+static void* checked(void* pointer) {
+    if (pointer == NULL) {
+        exit(1);
+    }
+    return pointer;
+}
@@ -0,0 +1,53 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common.h"
+
+// Where reallocate() gets its memory from. With SLAB_ALLOCATOR, small blocks
+// come from per-size-class slabs and large ones are mapped directly; otherwise
+// everything goes to malloc. Callers always pass the size they asked for when
+// resizing or freeing a block, so no block carries a header.
+#ifdef SLAB_ALLOCATOR
+#define SLAB_CLASS_COUNT 24
+#define MAPPING_CACHE_SIZE 8
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct Slab {
+    struct Slab* next; // the slabs of an allocator are linked through their first block
+} Slab;
+
+typedef struct {
+    FreeBlock* freeList;
+    uint8_t* slabTop; // the untouched rest of the newest slab
+    uint8_t* slabEnd;
+} SizeClass;
+
+typedef struct {
+    void* start;
+    size_t size;
+} Mapping;
+#endif
+
+// Each VM has an allocator of its own, so VMs on different threads never share
+// a free list and need no locks.
+typedef struct {
+#ifdef SLAB_ALLOCATOR
+    SizeClass classes[SLAB_CLASS_COUNT];
+    Slab* slabs;
+    Mapping mappingCache[MAPPING_CACHE_SIZE];
+    int mappingCacheCount;
+    size_t pageSize;
+#else
+    int unused; // malloc keeps its own state
+#endif
+} Allocator;
+
+void initAllocator(Allocator* allocator);
+void freeAllocator(Allocator* allocator);
+void sealAllocator(Allocator* allocator);
+void* reallocateBlock(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize);
+
+#endif
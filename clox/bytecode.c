@@ -0,0 +1,597 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define BYTECODE_MAGIC 0x43584f4c // "LOXC" on a little-endian machine
+#define BYTECODE_VERSION 2 // bump whenever the instruction set or the layout changes
+
+// The header is followed by these sections, each starting on a 4-byte boundary:
+//   the source path, with its terminator
+//   the code
+//   the line table, as LineStart entries
+//   the constants, each a tag byte followed by a double for numbers, or by a
+//   uint32_t length and the characters for strings
+//   the global names in slot order, each a uint32_t length and the characters
+// Everything is stored in the byte order of the machine that wrote the file. A
+// file from a machine with the other byte order fails the magic check.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t sourcePathLength;
+    uint32_t codeLength;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t globalCount;
+    uint32_t reserved; // keeps the header a multiple of 8 bytes
+} BytecodeHeader;
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+} ConstantTag;
+
+typedef struct {
+    uint8_t* start;
+    size_t size;
+    size_t offset;
+} Reader;
+
+static void writePadding(FILE* file);
+static void writeString(FILE* file, ObjString* string);
+static void writeConstant(FILE* file, Value value);
+static uint8_t* readBytes(Reader* reader, size_t length);
+static bool readUint32(Reader* reader, uint32_t* value);
+static ObjString* readString(VM* vm, Reader* reader);
+static bool readConstant(VM* vm, Reader* reader, Value* value);
+static bool loadConstants(VM* vm, Reader* reader, Chunk* chunk, uint32_t count);
+static bool loadGlobals(VM* vm, Reader* reader, Chunk* chunk, uint32_t count);
+static void alignReader(Reader* reader);
+static bool patchGlobals(Chunk* chunk, int* slots, int slotCount);
+static int globalOperand(uint8_t instruction);
+static bool verifyCode(Chunk* chunk, uint32_t globalCount);
+static bool verifyOperands(Chunk* chunk, int offset, uint32_t globalCount);
+static bool checkBytecode(Bytecode* bytecode, const char* name, FILE* errors);
+static void unmapBytecode(Bytecode* bytecode);
+
+// FNV-1a, 64 bits wide so that a stale cache is practically never missed
+uint64_t hashSource(const char* source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool isBytecodeFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    uint32_t magic = 0;
+    size_t read = fread(&magic, sizeof(magic), 1, file);
+    fclose(file);
+    return read == 1 && magic == BYTECODE_MAGIC;
+}
+
+bool isBytecode(const uint8_t* data, size_t size) {
+    uint32_t magic = 0;
+    if (size >= sizeof(magic)) {
+        memcpy(&magic, data, sizeof(magic));
+    }
+    return magic == BYTECODE_MAGIC;
+}
+
+// Writes the chunk, which must have been compiled by this VM, to path. The file
+// is written under a temporary name and renamed into place, so a concurrent
+// run never maps a half-written cache.
+bool writeBytecode(VM* vm, Chunk* chunk, const char* source, const char* sourcePath, const char* path) {
+    char* absolutePath = realpath(sourcePath, NULL);
+    if (absolutePath == NULL) {
+        return false;
+    }
+
+    size_t pathLength = strlen(path);
+    char* tempPath = malloc(pathLength + 5);
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", 5);
+
+    FILE* file = fopen(tempPath, "wb");
+    if (file == NULL) {
+        free(absolutePath);
+        free(tempPath);
+        return false;
+    }
+
+    BytecodeHeader header;
+    header.magic = BYTECODE_MAGIC;
+    header.version = BYTECODE_VERSION;
+    header.sourceHash = hashSource(source);
+    header.sourcePathLength = (uint32_t)strlen(absolutePath);
+    header.codeLength = (uint32_t)chunk->count;
+    header.lineCount = (uint32_t)chunk->lineCount;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.globalCount = (uint32_t)vm->globalNames.count;
+    header.reserved = 0;
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(absolutePath, 1, header.sourcePathLength + 1, file);
+    writePadding(file);
+    fwrite(chunk->code, 1, chunk->count, file);
+    writePadding(file);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, file);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstant(file, chunk->constants.values[i]);
+    }
+    for (int i = 0; i < vm->globalNames.count; i++) {
+        writeString(file, AS_STRING(vm->globalNames.values[i]));
+    }
+
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    written = written && rename(tempPath, path) == 0;
+    if (!written) {
+        remove(tempPath);
+    }
+
+    free(absolutePath);
+    free(tempPath);
+    return written;
+}
+
+// Maps the file and checks its header, reporting what is wrong with it to
+// errors. The chunk is not usable until loadBytecode() is called, which gives
+// the caller a chance to check the source hash first.
+bool mapBytecode(const char* path, Bytecode* bytecode, FILE* errors) {
+    initChunk(&bytecode->chunk);
+    bytecode->mapping = NULL;
+    bytecode->mappingSize = 0;
+    bytecode->untrusted = false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(errors, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(BytecodeHeader)) {
+        close(fd);
+        fprintf(errors, "\"%s\" is not a bytecode file.\n", path);
+        return false;
+    }
+
+    // private and writable, so patching global slots copies only the pages it touches
+    void* mapping = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(errors, "Could not map file \"%s\".\n", path);
+        return false;
+    }
+    bytecode->mapping = mapping;
+    bytecode->mappingSize = status.st_size;
+    return checkBytecode(bytecode, path, errors);
+}
+
+// Like mapBytecode(), for the contents of a bytecode file that arrived some
+// other way, such as over the --serve socket. They are copied into a mapping of
+// their own, so the bytecode is freed the same way. name stands in for the path
+// in error messages.
+bool copyBytecode(const uint8_t* data, size_t size, const char* name, Bytecode* bytecode, FILE* errors) {
+    initChunk(&bytecode->chunk);
+    bytecode->mapping = NULL;
+    bytecode->mappingSize = 0;
+    bytecode->untrusted = false;
+
+    if (size < sizeof(BytecodeHeader)) {
+        fprintf(errors, "\"%s\" is not a bytecode file.\n", name);
+        return false;
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(errors, "Not enough memory to load \"%s\".\n", name);
+        return false;
+    }
+    memcpy(mapping, data, size);
+    bytecode->mapping = mapping;
+    bytecode->mappingSize = size;
+    if (!checkBytecode(bytecode, name, errors)) {
+        return false;
+    }
+    bytecode->untrusted = true;
+    return true;
+}
+
+// Builds the chunk from a mapped file. The code and the line table are used in
+// place; the constant strings are interned and the global names are resolved
+// to this VM's slots. The code is verified before the global slots are patched
+// or anything runs it, since even a file --compile wrote may have been damaged
+// on disk since.
+bool loadBytecode(VM* vm, Bytecode* bytecode) {
+    BytecodeHeader* header = (BytecodeHeader*)bytecode->mapping;
+    Chunk* chunk = &bytecode->chunk;
+    Reader reader = { bytecode->mapping, bytecode->mappingSize, sizeof(BytecodeHeader) };
+
+    readBytes(&reader, (size_t)header->sourcePathLength + 1);
+    alignReader(&reader);
+    uint8_t* code = readBytes(&reader, header->codeLength);
+    alignReader(&reader);
+    LineStart* lines = (LineStart*)readBytes(&reader, (size_t)header->lineCount * sizeof(LineStart));
+    if (code == NULL || lines == NULL) {
+        fprintf(vm->errors, "Bytecode file is truncated.\n");
+        return false;
+    }
+
+    chunk->code = code;
+    chunk->count = header->codeLength;
+    chunk->capacity = header->codeLength;
+    chunk->lines = lines;
+    chunk->lineCount = header->lineCount;
+    chunk->lineCapacity = header->lineCount;
+
+    // the chunk is a root while it is loaded, so a collection started by an
+    // allocation below doesn't free the strings loaded so far
+    vm->chunk = chunk;
+    bool loaded = loadConstants(vm, &reader, chunk, header->constantCount);
+    if (loaded && !verifyCode(chunk, header->globalCount)) {
+        fprintf(vm->errors, "Bytecode file is not valid.\n");
+        loaded = false;
+    }
+    loaded = loaded && loadGlobals(vm, &reader, chunk, header->globalCount);
+    vm->chunk = NULL;
+    return loaded;
+}
+
+void freeBytecode(VM* vm, Bytecode* bytecode) {
+    // the code and the line table belong to the mapping, not to the chunk
+    bytecode->chunk.code = NULL;
+    bytecode->chunk.capacity = 0;
+    bytecode->chunk.lines = NULL;
+    bytecode->chunk.lineCapacity = 0;
+    freeChunk(vm, &bytecode->chunk);
+    unmapBytecode(bytecode);
+}
+
+static void writePadding(FILE* file) {
+    static const uint8_t zeros[4] = { 0 };
+    long offset = ftell(file);
+    if (offset % 4 != 0) {
+        fwrite(zeros, 1, 4 - offset % 4, file);
+    }
+}
+
+static void writeString(FILE* file, ObjString* string) {
+    uint32_t length = (uint32_t)string->length;
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(string->chars, 1, string->length, file);
+}
+
+static void writeConstant(FILE* file, Value value) {
+    uint8_t tag;
+    if (IS_NIL(value)) {
+        tag = CONSTANT_NIL;
+    } else if (IS_BOOL(value)) {
+        tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+    } else if (IS_NUMBER(value)) {
+        tag = CONSTANT_NUMBER;
+    } else {
+        tag = CONSTANT_STRING;
+    }
+    fwrite(&tag, 1, 1, file);
+
+    if (tag == CONSTANT_NUMBER) {
+        double number = AS_NUMBER(value);
+        fwrite(&number, sizeof(number), 1, file);
+    } else if (tag == CONSTANT_STRING) {
+        writeString(file, AS_STRING(value));
+    }
+}
+
+// Returns the next length bytes, or NULL if the file ends before them.
+static uint8_t* readBytes(Reader* reader, size_t length) {
+    if (length > reader->size - reader->offset) {
+        return NULL;
+    }
+    uint8_t* bytes = reader->start + reader->offset;
+    reader->offset += length;
+    return bytes;
+}
+
+// Values past the aligned sections are unaligned, so they are copied out.
+static bool readUint32(Reader* reader, uint32_t* value) {
+    uint8_t* bytes = readBytes(reader, sizeof(uint32_t));
+    if (bytes == NULL) {
+        return false;
+    }
+    memcpy(value, bytes, sizeof(uint32_t));
+    return true;
+}
+
+static ObjString* readString(VM* vm, Reader* reader) {
+    uint32_t length;
+    if (!readUint32(reader, &length)) {
+        return NULL;
+    }
+    uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) {
+        return NULL;
+    }
+    return copySharedString(vm, (const char*)chars, (int)length);
+}
+
+static bool readConstant(VM* vm, Reader* reader, Value* value) {
+    uint8_t* tag = readBytes(reader, 1);
+    if (tag == NULL) {
+        return false;
+    }
+
+    switch (*tag) {
+        case CONSTANT_NIL: *value = NIL_VAL; return true;
+        case CONSTANT_FALSE: *value = BOOL_VAL(false); return true;
+        case CONSTANT_TRUE: *value = BOOL_VAL(true); return true;
+        case CONSTANT_NUMBER: {
+            uint8_t* bytes = readBytes(reader, sizeof(double));
+            if (bytes == NULL) {
+                return false;
+            }
+            double number;
+            memcpy(&number, bytes, sizeof(double));
+            *value = NUMBER_VAL(number);
+            return true;
+        }
+        case CONSTANT_STRING: {
+            ObjString* string = readString(vm, reader);
+            if (string == NULL) {
+                return false;
+            }
+            *value = OBJ_VAL(string);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool loadConstants(VM* vm, Reader* reader, Chunk* chunk, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        Value value;
+        if (!readConstant(vm, reader, &value)) {
+            fprintf(vm->errors, "Bytecode file is truncated.\n");
+            return false;
+        }
+        push(vm, value);
+        writeValueArray(vm, &chunk->constants, value);
+        pop(vm);
+    }
+    chunk->constantRequests = chunk->constants.count;
+    return true;
+}
+
+// Resolves the global names to this VM's slots. In a fresh VM every global
+// gets the slot it had when the file was written, and the code is left alone.
+static bool loadGlobals(VM* vm, Reader* reader, Chunk* chunk, uint32_t count) {
+    // every name takes at least its 4-byte length, so a count the rest of the
+    // file can't hold is refused before it sizes an allocation
+    if (count > (reader->size - reader->offset) / sizeof(uint32_t)) {
+        fprintf(vm->errors, "Bytecode file is truncated.\n");
+        return false;
+    }
+    int* slots = ALLOCATE(vm, int, count);
+    bool moved = false;
+    for (uint32_t i = 0; i < count; i++) {
+        ObjString* name = readString(vm, reader);
+        if (name == NULL) {
+            FREE_ARRAY(vm, int, slots, count);
+            fprintf(vm->errors, "Bytecode file is truncated.\n");
+            return false;
+        }
+        slots[i] = globalSlot(vm, name);
+        moved = moved || slots[i] != (int)i;
+    }
+
+    bool patched = !moved || patchGlobals(chunk, slots, count);
+    FREE_ARRAY(vm, int, slots, count);
+    if (!patched) {
+        fprintf(vm->errors, "Bytecode file doesn't fit the globals of this VM.\n");
+        return false;
+    }
+    return true;
+}
+
+static void alignReader(Reader* reader) {
+    reader->offset = (reader->offset + 3) & ~(size_t)3;
+    if (reader->offset > reader->size) {
+        reader->offset = reader->size;
+    }
+}
+
+// Rewrites the global slot operands in the code when this VM gave the globals
+// different slots. It fails if a slot no longer fits the operand the compiler
+// picked for it.
+static bool patchGlobals(Chunk* chunk, int* slots, int slotCount) {
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        int size = instructionSize(instruction);
+        int operand = globalOperand(instruction);
+
+        if (operand != 0) {
+            // only the _LONG instructions are 4 bytes long
+            bool wide = size == 4;
+            int oldSlot = wide ? readLongOperand(chunk, offset + operand) : chunk->code[offset + operand];
+            if (oldSlot >= slotCount) {
+                return false;
+            }
+
+            int slot = slots[oldSlot];
+            if (wide) {
+                chunk->code[offset + operand] = (uint8_t)((slot >> 16) & 0xff);
+                chunk->code[offset + operand + 1] = (uint8_t)((slot >> 8) & 0xff);
+                chunk->code[offset + operand + 2] = (uint8_t)(slot & 0xff);
+            } else if (slot <= UINT8_MAX) {
+                chunk->code[offset + operand] = (uint8_t)slot;
+            } else {
+                return false;
+            }
+        }
+
+        offset += size;
+    }
+    return true;
+}
+
+// Returns where the global slot operand starts in an instruction, or 0 if it
+// has none.
+static int globalOperand(uint8_t instruction) {
+    switch (instruction) {
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_GLOBAL_CONSTANT_ADD:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_POP:
+            return 1;
+        case OP_CONSTANT_DEFINE_GLOBAL:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// Checks the code of a bytecode file before anything trusts it. Every
+// instruction must be one clox knows and have all of its operands, and refer
+// only to the constants and the globals the file brought. The stack must stay
+// within STACK_MAX, the code must end by returning, and the line table must
+// start with the first instruction and run in order, as getLine() expects.
+static bool verifyCode(Chunk* chunk, uint32_t globalCount) {
+    if (chunk->lineCount == 0 || chunk->lines[0].offset != 0) {
+        return false;
+    }
+    for (int i = 1; i < chunk->lineCount; i++) {
+        if (chunk->lines[i].offset <= chunk->lines[i - 1].offset) {
+            return false;
+        }
+    }
+
+    int last = -1;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset])) {
+        if (instructionSize(chunk->code[offset]) > chunk->count - offset
+                || !verifyOperands(chunk, offset, globalCount)) {
+            return false;
+        }
+        last = offset;
+    }
+    if (last < 0 || chunk->code[last] != OP_RETURN) {
+        return false;
+    }
+
+    // the operands are all there now, so the stack can be followed through them
+    return checkStackDepth(chunk, STACK_MAX) < 0;
+}
+
+// Checks the constant and global operands of the instruction at offset, whose
+// bytes are all within the code. Local slots and pop counts are left to
+// checkStackDepth().
+static bool verifyOperands(Chunk* chunk, int offset, uint32_t globalCount) {
+    uint8_t* code = chunk->code + offset;
+    uint32_t constantCount = (uint32_t)chunk->constants.count;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            return code[1] < constantCount;
+        case OP_CONSTANT_LONG:
+            return (uint32_t)readLongOperand(chunk, offset + 1) < constantCount;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            return code[1] < globalCount;
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return (uint32_t)readLongOperand(chunk, offset + 1) < globalCount;
+        case OP_CONSTANT_DEFINE_GLOBAL:
+            return code[1] < constantCount && code[2] < globalCount;
+        case OP_GET_GLOBAL_CONSTANT_ADD:
+            return code[1] < globalCount && code[2] < constantCount;
+        case OP_CONCAT_N:
+            // the compiler never adds fewer than two values at once
+            return code[1] >= 2;
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_ADD:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_MULTIPLY:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_NOT_EQUAL:
+        case OP_SUBTRACT:
+        case OP_GET_LOCAL:
+        case OP_POP:
+        case OP_POPN:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Checks the header and finds the source path; on failure the mapping is gone.
+static bool checkBytecode(Bytecode* bytecode, const char* name, FILE* errors) {
+    BytecodeHeader* header = (BytecodeHeader*)bytecode->mapping;
+    if (header->magic != BYTECODE_MAGIC) {
+        fprintf(errors, "\"%s\" is not a bytecode file.\n", name);
+        unmapBytecode(bytecode);
+        return false;
+    }
+    if (header->version != BYTECODE_VERSION) {
+        fprintf(errors, "\"%s\" was compiled by another version of clox.\n", name);
+        unmapBytecode(bytecode);
+        return false;
+    }
+
+    Reader reader = { bytecode->mapping, bytecode->mappingSize, sizeof(BytecodeHeader) };
+    uint8_t* sourcePath = readBytes(&reader, (size_t)header->sourcePathLength + 1);
+    if (sourcePath == NULL || sourcePath[header->sourcePathLength] != '\0') {
+        fprintf(errors, "\"%s\" is truncated.\n", name);
+        unmapBytecode(bytecode);
+        return false;
+    }
+
+    bytecode->sourceHash = header->sourceHash;
+    bytecode->sourcePath = (const char*)sourcePath;
+    return true;
+}
+
+// the chunk of a bytecode file that was never loaded owns nothing yet
+static void unmapBytecode(Bytecode* bytecode) {
+    if (bytecode->mapping != NULL) {
+        munmap(bytecode->mapping, bytecode->mappingSize);
+        bytecode->mapping = NULL;
+        bytecode->mappingSize = 0;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "chunk.h"
+#include "common.h"
+
+// A compiled chunk saved to disk (a .loxc file). The code and the line table
+// are used straight from a private memory mapping of the file. Only the
+// constants are rebuilt when the file is loaded, and only global slots that
+// differ in this VM are patched.
+typedef struct {
+    Chunk chunk; // valid after loadBytecode()
+    uint8_t* mapping;
+    size_t mappingSize;
+    uint64_t sourceHash; // hash of the source the chunk was compiled from
+    const char* sourcePath; // absolute path of that source, inside the mapping
+    // set by copyBytecode(): the bytecode came from a client, so its source
+    // path means nothing here
+    bool untrusted;
+} Bytecode;
+
+uint64_t hashSource(const char* source);
+bool isBytecodeFile(const char* path);
+bool isBytecode(const uint8_t* data, size_t size);
+bool writeBytecode(VM* vm, Chunk* chunk, const char* source, const char* sourcePath, const char* path);
+bool mapBytecode(const char* path, Bytecode* bytecode, FILE* errors);
+bool copyBytecode(const uint8_t* data, size_t size, const char* name, Bytecode* bytecode, FILE* errors);
+bool loadBytecode(VM* vm, Bytecode* bytecode);
+void freeBytecode(VM* vm, Bytecode* bytecode);
+
+#endif
@@ -1,38 +1,321 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static int findConstant(int* index, int capacity, ValueArray* constants, Value value);
+static void growConstantIndex(VM* vm, Chunk* chunk);
+static bool sameConstant(Value a, Value b);
+static uint32_t hashConstant(Value value);
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+    chunk->constantRequests = 0;
+#ifdef DIRECT_THREADED
+    chunk->threadedCode = NULL;
+#endif
     initValueArray(&chunk->constants);
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(uint8_t, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
+#ifdef DIRECT_THREADED
+    FREE_ARRAY(vm, ThreadedOp, chunk->threadedCode, chunk->count);
+#endif
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // bytes from the line of the previous one just extend its run
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+// Returns the source line of the byte at offset, with a binary search for the
+// last run that starts at or before it.
+int getLine(Chunk* chunk, int offset) {
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    for (;;) {
+        int mid = (start + end) / 2;
+        LineStart* line = &chunk->lines[mid];
+        if (offset < line->offset) {
+            end = mid - 1;
+        } else if (mid == chunk->lineCount - 1 || offset < chunk->lines[mid + 1].offset) {
+            return line->line;
+        } else {
+            start = mid + 1;
+        }
+    }
 }
 
-// Returns the index where the constant is added.
-int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+// Returns the index of the constant, reusing the slot of an identical constant
+// that is already in the pool.
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+    chunk->constantRequests++;
+
+    if (chunk->constants.count + 1 > chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD) {
+        push(vm, value);
+        growConstantIndex(vm, chunk);
+        pop(vm);
+    }
+
+    int bucket = findConstant(chunk->constantIndex, chunk->constantIndexCapacity, &chunk->constants, value);
+    if (chunk->constantIndex[bucket] != -1) {
+        return chunk->constantIndex[bucket];
+    }
+
+    push(vm, value); // growing the pool can start a collection
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
+    chunk->constantIndex[bucket] = chunk->constants.count - 1;
     return chunk->constants.count - 1;
 }
+
+// Returns the bucket that holds the constant, or the empty bucket where it belongs.
+static int findConstant(int* index, int capacity, ValueArray* constants, Value value) {
+    uint32_t bucket = hashConstant(value) & (capacity - 1);
+    for (;;) {
+        int constant = index[bucket];
+        if (constant == -1 || sameConstant(constants->values[constant], value)) {
+            return bucket;
+        }
+        bucket = (bucket + 1) & (capacity - 1);
+    }
+}
+
+static void growConstantIndex(VM* vm, Chunk* chunk) {
+    int capacity = GROW_CAPACITY(chunk->constantIndexCapacity);
+    int* index = ALLOCATE(vm, int, capacity);
+    for (int i = 0; i < capacity; i++) {
+        index[i] = -1;
+    }
+
+    // the pool never holds duplicates, so every constant gets its own bucket
+    for (int i = 0; i < chunk->constants.count; i++) {
+        int bucket = findConstant(index, capacity, &chunk->constants, chunk->constants.values[i]);
+        index[bucket] = i;
+    }
+
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndex = index;
+    chunk->constantIndexCapacity = capacity;
+}
+
+// Constants can share a slot only if nothing can tell them apart, which is
+// stricter than valuesEqual(): 0 and -0 must stay separate, and a NaN has to
+// match itself. Strings are interned, so comparing pointers is enough.
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER:
+            return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b);
+        default:
+            return true;
+    }
+#endif
+}
+
+static uint32_t hashConstant(Value value) {
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    switch (value.type) {
+        case VAL_BOOL: bits = AS_BOOL(value); break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ: bits = (uintptr_t)AS_OBJ(value); break;
+        default: bits = 0; break;
+    }
+#endif
+    // mix the high bits in, so small integers and aligned pointers still spread out
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Writes an instruction with a one byte operand, or its long form with a three
+// byte (big-endian) operand when the operand doesn't fit in a byte.
+void writeOperand(VM* vm, Chunk* chunk, uint8_t opcode, uint8_t longOpcode, int operand, int line) {
+    if (operand <= UINT8_MAX) {
+        writeChunk(vm, chunk, opcode, line);
+        writeChunk(vm, chunk, (uint8_t)operand, line);
+        return;
+    }
+
+    writeChunk(vm, chunk, longOpcode, line);
+    writeChunk(vm, chunk, (uint8_t)((operand >> 16) & 0xff), line);
+    writeChunk(vm, chunk, (uint8_t)((operand >> 8) & 0xff), line);
+    writeChunk(vm, chunk, (uint8_t)(operand & 0xff), line);
+}
+
+// Reads the three byte operand that starts at offset.
+int readLongOperand(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+// Returns the number of bytes an instruction takes, including its operands.
+int instructionSize(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_CONCAT_N:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_POPN:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_CONSTANT_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL_CONSTANT_ADD:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Follows the stack through the code, which has no jumps, so a single pass in
+// order sees every depth the stack reaches. Returns the offset of the first
+// instruction that would take the stack past max values, use a value that
+// isn't on it or read a local slot above it, or -1 if there is none.
+int checkStackDepth(Chunk* chunk, int max) {
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset])) {
+        uint8_t instruction = chunk->code[offset];
+        int pops = 0; // values the instruction takes off the stack
+        int pushes = 0; // values it leaves in their place
+        int extra = 0; // values it pushes on top of those for a while
+        int local = -1; // the local slot it uses, which must stay below the popped values
+
+        switch (instruction) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_NIL:
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                pushes = 1;
+                break;
+            case OP_GET_GLOBAL_CONSTANT_ADD:
+                // the global and the constant are only pushed when they aren't numbers
+                pushes = 1;
+                extra = 1;
+                break;
+            case OP_ADD:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_MULTIPLY:
+            case OP_NOT_EQUAL:
+            case OP_SUBTRACT:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_CONCAT_N:
+                // unless its operands are all numbers or short strings, addN()
+                // adds them a pair at a time, pushing each pair on top of them
+                pops = chunk->code[offset + 1];
+                pushes = 1;
+                extra = pops + 1;
+                break;
+            case OP_NEGATE:
+            case OP_NOT:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_POP:
+            case OP_PRINT:
+            case OP_SET_GLOBAL_POP:
+                pops = 1;
+                break;
+            case OP_POPN:
+                pops = chunk->code[offset + 1];
+                break;
+            case OP_GET_LOCAL:
+                pushes = 1;
+                local = chunk->code[offset + 1];
+                break;
+            case OP_SET_LOCAL:
+                pops = 1;
+                pushes = 1;
+                local = chunk->code[offset + 1];
+                break;
+            case OP_SET_LOCAL_POP:
+                pops = 1;
+                local = chunk->code[offset + 1];
+                break;
+            default:
+                // OP_RETURN and OP_CONSTANT_DEFINE_GLOBAL leave the stack alone
+                break;
+        }
+
+        if (pops > depth || local >= depth - pops) {
+            return offset;
+        }
+        depth += pushes - pops;
+        if (depth + extra > max) {
+            return offset;
+        }
+    }
+    return -1;
+}
@@ -6,41 +6,90 @@
 
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_TRUE,
     OP_FALSE,
     OP_NIL,
 
     // operators
     OP_ADD,
+    OP_CONCAT_N, // adds its operand count of values, left to right
     OP_DIVIDE,
     OP_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_MULTIPLY,
     OP_NEGATE,
     OP_NOT,
+    OP_NOT_EQUAL,
     OP_SUBTRACT,
 
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
+    OP_GET_LOCAL,
     OP_POP,
+    OP_POPN,
     OP_PRINT,
     OP_RETURN,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
+    OP_SET_LOCAL,
+
+    // superinstructions, fused by the optimizer from the most frequent
+    // sequences (see DEBUG_OPCODE_STATS)
+    OP_CONSTANT_DEFINE_GLOBAL, // OP_CONSTANT, OP_DEFINE_GLOBAL
+    OP_GET_GLOBAL_CONSTANT_ADD, // OP_GET_GLOBAL, OP_CONSTANT, OP_ADD
+    OP_SET_GLOBAL_POP, // OP_SET_GLOBAL, OP_POP
+    OP_SET_LOCAL_POP, // OP_SET_LOCAL, OP_POP
 
 } OpCode;
 
+#ifdef DIRECT_THREADED
+// A pre-decoded chunk has one slot per bytecode byte, so offsets stay the same.
+// Opcodes are replaced by the address of their handler in run().
+typedef union {
+    void* handler;
+    uintptr_t operand;
+} ThreadedOp;
+#endif
+
+// The line table is run-length encoded: one entry for each run of bytecode
+// that comes from the same source line.
+typedef struct {
+    int offset; // the offset of the first byte in the run
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines; // A parallel array that stores the line numbers
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    // open-addressed hash index over the constants, so addConstant() can hand
+    // back the slot of an identical constant instead of appending a new one
+    int* constantIndex;
+    int constantIndexCapacity;
+    int constantRequests; // number of addConstant() calls, for the pool statistics
+#ifdef DIRECT_THREADED
+    ThreadedOp* threadedCode; // built by run() the first time the chunk executes
+#endif
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+int getLine(Chunk* chunk, int offset);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+void writeOperand(VM* vm, Chunk* chunk, uint8_t opcode, uint8_t longOpcode, int operand, int line);
+int readLongOperand(Chunk* chunk, int offset);
+int instructionSize(uint8_t instruction);
+int checkStackDepth(Chunk* chunk, int max);
 
 #endif
@@ -5,9 +5,24 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// release builds (and the benchmarks) run without the debug output
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// dispatch through labels-as-values when the compiler supports them (GCC and
+// Clang); everything else falls back to the portable switch in run()
+#if defined(__GNUC__) && !defined(CLOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// direct threading needs the address of each handler
+#if defined(DIRECT_THREADED) && !defined(COMPUTED_GOTO)
+#undef DIRECT_THREADED
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff // the largest operand of the _LONG instructions
 
 #endif
@@ -1,57 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-static void initCompiler(Compiler* compiler);
-static void advance();
-static void consume(TokenType type, const char* message);
-static bool match(TokenType type);
-static bool check(TokenType type);
-static void declaration();
-static void varDeclaration();
-static uint8_t parseVariable(const char* errorMessage);
-static uint8_t identifierConstant(Token* name);
-static void defineVariable(uint8_t global);
-static void statement();
-static void beginScope();
-static void endScope();
-static void printStatement();
-static void expressionStatement();
-static void block();
-static void expression();
-static void grouping(bool canAssign);
-static void binary(bool canAssign);
-static void unary(bool canAssign);
-static void variable(bool canAssign);
-static void namedVariable(Token name, bool canAssign);
-static void number(bool canAssign);
-static void literal(bool canAssign);
-static void string(bool canAssign);
-static void parsePrecedence(Precedence precedence);
+// the most values one OP_CONCAT_N adds; longer chains take several, which keeps
+// the stack they need small
+#define CONCAT_MAX_OPERANDS 16
+
+static void initCompiler(Parser* parser, Compiler* compiler);
+static void advance(Parser* parser);
+static void consume(Parser* parser, TokenType type, const char* message);
+static bool match(Parser* parser, TokenType type);
+static bool check(Parser* parser, TokenType type);
+static void declaration(Parser* parser);
+static void varDeclaration(Parser* parser);
+static int parseVariable(Parser* parser, const char* errorMessage);
+static int identifierSlot(Parser* parser, Token* name);
+static void declareVariable(Parser* parser);
+static void addLocal(Parser* parser, Token name);
+static bool identifiersEqual(Token* a, Token* b);
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name);
+static void markInitialized(Parser* parser);
+static void defineVariable(Parser* parser, int global);
+static void statement(Parser* parser);
+static void beginScope(Parser* parser);
+static void endScope(Parser* parser);
+static void printStatement(Parser* parser);
+static void expressionStatement(Parser* parser);
+static void block(Parser* parser);
+static void expression(Parser* parser);
+static void grouping(Parser* parser, bool canAssign);
+static void binary(Parser* parser, bool canAssign);
+static void addChain(Parser* parser);
+static void unary(Parser* parser, bool canAssign);
+static void variable(Parser* parser, bool canAssign);
+static void namedVariable(Parser* parser, Token name, bool canAssign);
+static void number(Parser* parser, bool canAssign);
+static void literal(Parser* parser, bool canAssign);
+static void string(Parser* parser, bool canAssign);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 static ParseRule* getRule(TokenType type);
-static void endCompiler();
-static void emitReturn();
-static void emitConstant(Value value);
-static uint8_t makeConstant(Value value);
-static void emitByte(uint8_t byte);
-static void emitBytes(uint8_t byte1, uint8_t byte2);
-static Chunk* currentChunk();
-static void error(const char* message);
-static void errorAtCurrent(const char* message);
-static void errorAt(Token* token, const char* message);
-static void synchronize();
-
-Scanner scanner;
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
+static void endCompiler(Parser* parser);
+static void emitReturn(Parser* parser);
+static void emitConstant(Parser* parser, Value value);
+static int makeConstant(Parser* parser, Value value);
+static void emitByte(Parser* parser, uint8_t byte);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2);
+static void emitOperand(Parser* parser, uint8_t opcode, uint8_t longOpcode, int operand);
+static Chunk* currentChunk(Parser* parser);
+static void error(Parser* parser, const char* message);
+static void errorAtCurrent(Parser* parser, const char* message);
+static void errorAt(Parser* parser, Token* token, const char* message);
+static void synchronize(Parser* parser);
 
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = { grouping, NULL, PREC_NONE},
@@ -96,213 +105,342 @@ ParseRule rules[] = {
     [TOKEN_EOF] = { NULL, NULL, PREC_NONE},
 };
 
-bool compile(const char* source, Chunk* chunk) {
+bool compile(VM* vm, const char* source, Chunk* chunk) {
     // initialize compiler, scanner, chunk and parser
+    Parser parser;
     Compiler compiler;
-    initCompiler(&compiler);
-    initScanner(&scanner, source);
-    compilingChunk = chunk;
+    parser.vm = vm;
+    initCompiler(&parser, &compiler);
+    initScanner(&parser.scanner, source);
+    vm->compilingChunk = chunk;
     parser.hadError = false;
     parser.panicMode = false;
 
-    advance();
+    advance(&parser);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    endCompiler();
+    endCompiler(&parser);
+    vm->compilingChunk = NULL;
 
     return !parser.hadError;
 }
 
-static void initCompiler(Compiler* compiler) {
+// The constants of the chunk being compiled aren't reachable from the VM yet.
+void markCompilerRoots(VM* vm) {
+    Chunk* chunk = vm->compilingChunk;
+    if (chunk != NULL) {
+        for (int i = 0; i < chunk->constants.count; i++) {
+            markValue(vm, chunk->constants.values[i]);
+        }
+    }
+}
+
+static void initCompiler(Parser* parser, Compiler* compiler) {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    parser->compiler = compiler;
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken(&scanner);
+        parser->current = scanToken(&parser->scanner);
 
         // iterate over the error tokens and report the errors
-        if (parser.current.type != TOKEN_ERROR) {
+        if (parser->current.type != TOKEN_ERROR) {
             break;
         }
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool match(TokenType type) {
-    if (!check(type)) {
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) {
         return false;
     }
-    advance();
+    advance(parser);
     return true;
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static void declaration() {
-    if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name."); // the index of the variable name in the constants array
+static void varDeclaration(Parser* parser) {
+    int global = parseVariable(parser, "Expect variable name."); // the slot of the global variable
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(parser, global);
+}
+
+static int parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
+
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0) {
+        // locals are not looked up by name at runtime, so there is no global slot
+        return 0;
+    }
+
+    return identifierSlot(parser, &parser->previous);
+}
+
+// Returns the global slot the identifier resolves to.
+static int identifierSlot(Parser* parser, Token* name) {
+    int slot = globalSlot(parser->vm, copySharedString(parser->vm, name->start, name->length));
+
+    if (slot > UINT24_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) {
+        return;
+    }
+
+    Token* name = &parser->previous;
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
+            // shadowing a variable from an enclosing scope is fine
+            break;
+        }
+
+        if (identifiersEqual(name, &local->name)) {
+            error(parser, "Already a variable with this name in this scope.");
+        }
+    }
+
+    addLocal(parser, *name);
+}
+
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables.");
+        return;
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
+    local->name = name;
+    local->depth = -1; // declared but not yet initialized
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-    return identifierConstant(&parser.previous);
+static bool identifiersEqual(Token* a, Token* b) {
+    if (a->length != b->length) {
+        return false;
+    }
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+// Returns the stack slot of the local variable, or -1 if the name is not a local.
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
+    // walk backwards so that inner scopes shadow outer ones
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1) {
+                error(parser, "Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-// Returns the index where the identifier constant is added.
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static void markInitialized(Parser* parser) {
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    emitBytes(OP_DEFINE_GLOBAL, global);
+static void defineVariable(Parser* parser, int global) {
+    if (parser->compiler->scopeDepth > 0) {
+        // the initializer's value is already in the local's stack slot
+        markInitialized(parser);
+        return;
+    }
+
+    emitOperand(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-    current->scopeDepth--;
+static void endScope(Parser* parser) {
+    parser->compiler->scopeDepth--;
+
+    // discard the locals declared in the scope with a single instruction
+    int popCount = 0;
+    while (parser->compiler->localCount > 0
+            && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+        popCount++;
+        parser->compiler->localCount--;
+    }
+
+    // a scope can hold one more local than an operand can count
+    while (popCount > UINT8_MAX) {
+        emitBytes(parser, OP_POPN, UINT8_MAX);
+        popCount -= UINT8_MAX;
+    }
+    if (popCount == 1) {
+        emitByte(parser, OP_POP);
+    } else if (popCount > 1) {
+        emitBytes(parser, OP_POPN, (uint8_t)popCount);
+    }
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void expression() {
+static void expression(Parser* parser) {
     // parse the lowest precedence level, which subsumes all of the higher-precedence expressions too
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void binary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
     // compile the right operand
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
         // arithmetic
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            if (check(parser, TOKEN_PLUS)) {
+                addChain(parser);
+            } else {
+                emitByte(parser, OP_ADD);
+            }
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitByte(parser, OP_SUBTRACT);
             break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
+            emitByte(parser, OP_MULTIPLY);
             break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
+            emitByte(parser, OP_DIVIDE);
             break;
         // logical
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL);
+            emitByte(parser, OP_EQUAL);
             break;
         case TOKEN_BANG_EQUAL:
-            // a != b is equivalent to !(a == b)
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitByte(parser, OP_NOT_EQUAL);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitByte(parser, OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            // a >= b is equivalent to !(a < b)
-            emitBytes(OP_LESS, OP_NOT);
+            emitByte(parser, OP_GREATER_EQUAL);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitByte(parser, OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            // a <= b is equivalent to !(a > b)
-            emitBytes(OP_GREATER, OP_NOT);
+            emitByte(parser, OP_LESS_EQUAL);
+            break;
         default:
             // unreachable
             return;
     }
 }
 
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+// Compiles the rest of a + b + c + ..., once a and b are on the stack, into a
+// single OP_CONCAT_N, so the intermediate sums are never built.
+static void addChain(Parser* parser) {
+    int operandCount = 2;
+    while (match(parser, TOKEN_PLUS)) {
+        if (operandCount == CONCAT_MAX_OPERANDS) {
+            // the sum so far becomes the first operand of the next instruction
+            emitBytes(parser, OP_CONCAT_N, (uint8_t)operandCount);
+            operandCount = 1;
+        }
+        parsePrecedence(parser, PREC_FACTOR);
+        operandCount++;
+    }
+    emitBytes(parser, OP_CONCAT_N, (uint8_t)operandCount);
+}
+
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // compile the operand
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // emit the operator instruction
     switch (operatorType) {
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            emitByte(parser, OP_NOT);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitByte(parser, OP_NEGATE);
             break;
         default:
             // unreachable
@@ -310,37 +448,49 @@ static void unary(bool canAssign) {
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void namedVariable(Token name, bool canAssign) {
-    uint8_t arg = identifierConstant(&name);
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
+    uint8_t getOp, setOp, getLongOp, setLongOp;
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    if (arg != -1) {
+        // locals never need a long operand, there are at most UINT8_COUNT of them
+        getOp = getLongOp = OP_GET_LOCAL;
+        setOp = setLongOp = OP_SET_LOCAL;
+    } else {
+        arg = identifierSlot(parser, &name);
+        getOp = OP_GET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setOp = OP_SET_GLOBAL;
+        setLongOp = OP_SET_GLOBAL_LONG;
+    }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
         // if there is an equal sign, the variable is to be set, not get
-        expression();
-        emitBytes(OP_SET_GLOBAL, arg);
+        expression(parser);
+        emitOperand(parser, setOp, setLongOp, arg);
     } else {
-        emitBytes(OP_GET_GLOBAL, arg);
+        emitOperand(parser, getOp, getLongOp, arg);
     }
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitByte(parser, OP_TRUE);
             break;
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitByte(parser, OP_FALSE);
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitByte(parser, OP_NIL);
             break;
         default:
             // unreachable
@@ -348,35 +498,35 @@ static void literal(bool canAssign) {
     }
 }
 
-static void string(bool canAssign) {
+static void string(Parser* parser, bool canAssign) {
     // +1 and -2 trim the surrounding quotation marks
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(copySharedString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
 
     // prefix expressions (the first token always belongs to a prefix expression)
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     // consume = only if the precedence is no greater than assignment
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
     // infix expressions
     // consume the operator if its precedence is higher than the prefix operator
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -384,83 +534,99 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void endCompiler() {
-    emitReturn();
+static void endCompiler(Parser* parser) {
+    emitReturn(parser);
+    if (!parser->hadError) {
+        // expressions can nest deep enough to need more than the VM's stack
+        int offset = checkStackDepth(currentChunk(parser), STACK_MAX);
+        if (offset >= 0) {
+            fprintf(parser->vm->errors, "[line %d] Error: Expression needs too much stack space.\n",
+                    getLine(currentChunk(parser), offset));
+            parser->hadError = true;
+        }
+    }
+    if (!parser->hadError && parser->vm->optimizationLevel > 0) {
+        optimizeChunk(parser->vm, currentChunk(parser));
+    }
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if (!parser->hadError) {
+        disassembleChunk(parser->vm, currentChunk(parser), "code");
     }
 #endif
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void emitReturn(Parser* parser) {
+    emitByte(parser, OP_RETURN);
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+    emitOperand(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
 }
 
 // Returns the index where the value is added.
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static int makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
 
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+    if (constant > UINT24_MAX) {
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static Chunk* currentChunk() {
-    return compilingChunk;
+static void emitOperand(Parser* parser, uint8_t opcode, uint8_t longOpcode, int operand) {
+    writeOperand(parser->vm, currentChunk(parser), opcode, longOpcode, operand, parser->previous.line);
 }
 
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static Chunk* currentChunk(Parser* parser) {
+    return parser->vm->compilingChunk;
 }
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) {
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
+}
+
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) {
         return;
     }
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    parser->panicMode = true;
+    fprintf(parser->vm->errors, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->errors, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // nothing
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->errors, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->errors, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) {
             return;
         }
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -474,6 +640,6 @@ static void synchronize() {
                 ; // do nothing
         }
 
-        advance();
+        advance(parser);
     }
 }
\ No newline at end of file
@@ -5,7 +5,14 @@
 #include "scanner.h"
 #include "vm.h"
 
+typedef struct Compiler Compiler;
+
+// Everything one call to compile() works with, so that several VMs can compile
+// at the same time.
 typedef struct {
+    VM* vm; // owns the strings and the chunk being compiled
+    Scanner scanner;
+    Compiler* compiler;
     Token current;
     Token previous;
     bool hadError;
@@ -26,7 +33,7 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -39,12 +46,13 @@ typedef struct {
     int depth;
 } Local;
 
-typedef struct {
+struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
-} Compiler;
+};
 
-bool compile(const char* source, Chunk* chunk);
+bool compile(VM* vm, const char* source, Chunk* chunk);
+void markCompilerRoots(VM* vm);
 
 #endif
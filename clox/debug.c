@@ -1,32 +1,82 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset);
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset);
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset);
+static int globalLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset);
+static int byteInstruction(const char* name, Chunk* chunk, int offset);
+static int constantGlobalInstruction(VM* vm, const char* name, Chunk* chunk, int offset);
+static int globalConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset);
 static int simpleInstruction(const char* name, int offset);
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+static const char* opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NIL] = "OP_NIL",
+    [OP_ADD] = "OP_ADD",
+    [OP_CONCAT_N] = "OP_CONCAT_N",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS] = "OP_LESS",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_POP] = "OP_POP",
+    [OP_POPN] = "OP_POPN",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_CONSTANT_DEFINE_GLOBAL] = "OP_CONSTANT_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL_CONSTANT_ADD] = "OP_GET_GLOBAL_CONSTANT_ADD",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+};
+
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
+    printf("constants: %d in the pool, %d before deduplication\n",
+           chunk->constants.count, chunk->constantRequests);
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         // same line number as previous instruction
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_TRUE:
             return simpleInstruction("OP_TRUE", offset);
         case OP_FALSE:
@@ -36,34 +86,63 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         // operators
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+        case OP_CONCAT_N:
+            return byteInstruction("OP_CONCAT_N", chunk, offset);
         case OP_DIVIDE:
             return simpleInstruction("OP_DIVIDE", offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_MULTIPLY:
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalLongInstruction(vm, "OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalLongInstruction(vm, "OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
+        case OP_POPN:
+            return byteInstruction("OP_POPN", chunk, offset);
         case OP_PRINT:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction("OP_PRINT", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalLongInstruction(vm, "OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        // superinstructions
+        case OP_CONSTANT_DEFINE_GLOBAL:
+            return constantGlobalInstruction(vm, "OP_CONSTANT_DEFINE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_CONSTANT_ADD:
+            return globalConstantInstruction(vm, "OP_GET_GLOBAL_CONSTANT_ADD", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction(vm, "OP_SET_GLOBAL_POP", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -73,12 +152,129 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1]; // the operand is the index in constants
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 2;
+}
+
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1]; // the operand is the global slot
+    printf("%-16s %4d '", name, slot);
+    printValue(stdout, vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 2;
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = readLongOperand(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
     printf("'\n");
+    return offset + 4;
+}
+
+static int globalLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    int slot = readLongOperand(chunk, offset + 1);
+    printf("%-16s %4d '", name, slot);
+    printValue(stdout, vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t operand = chunk->code[offset + 1]; // a stack slot or a count
+    printf("%-16s %4d\n", name, operand);
     return offset + 2;
 }
 
+static int constantGlobalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t slot = chunk->code[offset + 2];
+    printf("%-16s %4d '", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' %4d '", slot);
+    printValue(stdout, vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int globalConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(stdout, vm->globalNames.values[slot]);
+    printf("' %4d '", constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
 }
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0])
+            || opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
+#ifdef DEBUG_OPCODE_STATS
+#define TOP_PAIRS 25
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} OpcodePair;
+
+static int comparePairs(const void* a, const void* b) {
+    uint64_t countA = ((const OpcodePair*)a)->count;
+    uint64_t countB = ((const OpcodePair*)b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+// Dumps the VM's executed opcode and opcode pair counts to stderr, most frequent first.
+void printOpcodeStats(VM* vm) {
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        total += vm->opcodeCounts[i];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    fprintf(stderr, "== opcode counts (%llu executed) ==\n", (unsigned long long)total);
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (vm->opcodeCounts[i] > 0) {
+            fprintf(stderr, "%-28s %12llu %6.2f%%\n", opcodeName(i),
+                    (unsigned long long)vm->opcodeCounts[i], 100.0 * vm->opcodeCounts[i] / total);
+        }
+    }
+
+    OpcodePair* pairs = malloc(sizeof(OpcodePair) * UINT8_COUNT * UINT8_COUNT);
+    int pairCount = 0;
+    uint64_t totalPairs = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            uint64_t count = vm->opcodePairs[first][second];
+            if (count > 0) {
+                pairs[pairCount++] = (OpcodePair){ (uint8_t)first, (uint8_t)second, count };
+                totalPairs += count;
+            }
+        }
+    }
+    qsort(pairs, pairCount, sizeof(OpcodePair), comparePairs);
+
+    fprintf(stderr, "== top opcode pairs ==\n");
+    for (int i = 0; i < pairCount && i < TOP_PAIRS; i++) {
+        fprintf(stderr, "%-20s %-20s %12llu %6.2f%%\n", opcodeName(pairs[i].first),
+                opcodeName(pairs[i].second), (unsigned long long)pairs[i].count,
+                100.0 * pairs[i].count / totalPairs);
+    }
+    free(pairs);
+}
+#endif
@@ -3,7 +3,12 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+// global names are printed as the given VM knows them
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+#ifdef DEBUG_OPCODE_STATS
+void printOpcodeStats(VM* vm);
+#endif
 
 #endif
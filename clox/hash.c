@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "hash.h"
+
+// the default secret of wyhash (final version 4)
+#define WY0 0x2d358dccaa6c78a5ull
+#define WY1 0x8bb84b93962eacc9ull
+#define WY2 0x4b33a62ed433d4a3ull
+#define WY3 0x4d5a2da51de1aa47ull
+
+static void multiply(uint64_t* a, uint64_t* b);
+static uint64_t mix(uint64_t a, uint64_t b);
+static uint64_t read8(const uint8_t* p);
+static uint64_t read4(const uint8_t* p);
+
+uint32_t hashFnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// wyhash by Wang Yi, which is in the public domain. Strings up to 16 bytes are
+// read as two possibly overlapping pairs of words without a loop; longer ones
+// go through three independent lanes of 16 bytes each, so the multiplies can
+// overlap. The 64-bit result is folded to the 32 bits an ObjString keeps.
+uint32_t hashWyhash(const char* key, int length) {
+    const uint8_t* p = (const uint8_t*)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = mix(WY0, WY1);
+    uint64_t a, b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            size_t middle = (remaining >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + middle);
+            b = (read4(p + remaining - 4) << 32) | read4(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (remaining >= 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = mix(read8(p) ^ WY1, read8(p + 8) ^ seed);
+                seed1 = mix(read8(p + 16) ^ WY2, read8(p + 24) ^ seed1);
+                seed2 = mix(read8(p + 32) ^ WY3, read8(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining >= 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = mix(read8(p) ^ WY1, read8(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // the last 16 bytes, which may overlap the ones already mixed
+        a = read8(p + remaining - 16);
+        b = read8(p + remaining - 8);
+    }
+
+    a ^= WY1;
+    b ^= seed;
+    multiply(&a, &b);
+    uint64_t hash = mix(a ^ WY0 ^ (uint64_t)length, b ^ WY1);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// the low half of the product goes to a, the high half to b
+static void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+// memcpy() compiles to a single unaligned load; on a big-endian machine the
+// hashes differ from a little-endian one. Heap images store the hashes of their
+// strings, so they depend on the hash staying the same; the image header's
+// hashCheck refuses an image written by a build or machine that hashes
+// differently
+static uint64_t read8(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read4(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
@@ -0,0 +1,21 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// Both string hashes are always built, so that the benchmark can compare them;
+// hashString() is the one the interpreter uses. STRING_HASH_FNV1A picks FNV-1a,
+// which reads a byte at a time; by default it is wyhash, which reads eight
+// bytes at a time and mixes them with a 64x64->128 bit multiply.
+uint32_t hashFnv1a(const char* key, int length);
+uint32_t hashWyhash(const char* key, int length);
+
+static inline uint32_t hashString(const char* key, int length) {
+#ifdef STRING_HASH_FNV1A
+    return hashFnv1a(key, length);
+#else
+    return hashWyhash(key, length);
+#endif
+}
+
+#endif
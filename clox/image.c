@@ -0,0 +1,275 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+#define IMAGE_MAGIC 0x49584f4c // "LOXI" on a little-endian machine
+#define IMAGE_VERSION 1 // bump whenever the layout of strings or values changes
+
+// strings are laid out back to back on 8-byte boundaries, like young objects
+#define ALIGN_IMAGE(size) (((size) + 7) & ~(size_t)7)
+
+// The header is followed by the strings section and then the globals. The
+// strings are stored as the ObjStrings they are in memory, marked from the
+// start like shared strings, so the collectors never write to them. Wherever
+// the image refers to a string, it stores its offset in the strings section
+// instead of a pointer, which is what makes the image relocatable. Like
+// bytecode files, images are only good for the machine and the build of clox
+// that wrote them; the header catches the differences that would matter.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t valueSize; // sizeof(Value), which NaN boxing changes
+    uint32_t hashCheck; // hashString() of HASH_CHECK_KEY, which the hash function changes
+    uint64_t stringsSize;
+    uint32_t stringCount;
+    uint32_t globalCount;
+} ImageHeader;
+
+typedef struct {
+    uint64_t name; // offset of the name in the strings section
+    Value value; // with the offset of a string in place of its pointer
+} ImageGlobal;
+
+#define HASH_CHECK_KEY "clox heap image"
+
+static void placeString(VM* vm, Table* offsets, ObjString** strings, uint32_t* count, uint64_t* size, ObjString* string);
+static uint64_t stringOffset(Table* offsets, ObjString* string);
+static void writeImageString(FILE* file, ObjString* string);
+static ObjString* resolveString(uint8_t* strings, uint64_t offset);
+
+// Writes the global variables that have been defined and the strings they
+// refer to. Ropes are flattened on the way, since the image holds nothing but
+// strings. The file is written under a temporary name and renamed into place.
+bool saveImage(VM* vm, const char* path) {
+    for (int i = 0; i < vm->globalValues.count; i++) {
+        if (IS_ROPE(vm->globalValues.values[i])) {
+            ObjString* flat = flattenRope(vm, AS_ROPE(vm->globalValues.values[i]));
+            vm->globalValues.values[i] = OBJ_VAL(flat);
+        }
+    }
+
+    // the strings are all interned, so each is written once, at the offset
+    // the table maps it to; it only holds strings the globals already hold
+    Table offsets;
+    initTable(&offsets);
+    // a name and a string value at most for each global
+    ObjString** strings = malloc(sizeof(ObjString*) * 2 * (vm->globalValues.count + 1));
+    if (strings == NULL) {
+        exit(1);
+    }
+    uint32_t stringCount = 0;
+    uint64_t stringsSize = 0;
+    uint32_t globalCount = 0;
+    for (int i = 0; i < vm->globalValues.count; i++) {
+        Value value = vm->globalValues.values[i];
+        if (IS_UNDEFINED(value)) {
+            continue;
+        }
+        globalCount++;
+        placeString(vm, &offsets, strings, &stringCount, &stringsSize, AS_STRING(vm->globalNames.values[i]));
+        if (IS_STRING(value)) {
+            placeString(vm, &offsets, strings, &stringCount, &stringsSize, AS_STRING(value));
+        }
+    }
+
+    size_t pathLength = strlen(path);
+    char* tempPath = malloc(pathLength + 5);
+    memcpy(tempPath, path, pathLength);
+    memcpy(tempPath + pathLength, ".tmp", 5);
+
+    bool written = false;
+    FILE* file = fopen(tempPath, "wb");
+    if (file != NULL) {
+        ImageHeader header;
+        header.magic = IMAGE_MAGIC;
+        header.version = IMAGE_VERSION;
+        header.valueSize = sizeof(Value);
+        header.hashCheck = hashString(HASH_CHECK_KEY, (int)strlen(HASH_CHECK_KEY));
+        header.stringsSize = stringsSize;
+        header.stringCount = stringCount;
+        header.globalCount = globalCount;
+        fwrite(&header, sizeof(header), 1, file);
+
+        for (uint32_t i = 0; i < stringCount; i++) {
+            writeImageString(file, strings[i]);
+        }
+
+        for (int i = 0; i < vm->globalValues.count; i++) {
+            Value value = vm->globalValues.values[i];
+            if (IS_UNDEFINED(value)) {
+                continue;
+            }
+
+            ImageGlobal global;
+            memset(&global, 0, sizeof(global));
+            global.name = stringOffset(&offsets, AS_STRING(vm->globalNames.values[i]));
+            if (IS_STRING(value)) {
+                value = OBJ_VAL((Obj*)(uintptr_t)stringOffset(&offsets, AS_STRING(value)));
+            }
+            global.value = value;
+            fwrite(&global, sizeof(global), 1, file);
+        }
+
+        written = !ferror(file);
+        written = fclose(file) == 0 && written;
+        written = written && rename(tempPath, path) == 0;
+        if (!written) {
+            remove(tempPath);
+        }
+    }
+
+    freeTable(vm, &offsets);
+    free(strings);
+    free(tempPath);
+    return written;
+}
+
+// Maps the image and makes its globals the VM's, resolving each string to the
+// copy the VM already has of it, if any. It is meant for a VM that hasn't run
+// anything yet; a global the VM already has is overwritten. The file is
+// trusted to come from --dump-image, so only its header is checked.
+bool loadImage(VM* vm, const char* path) {
+    if (vm->image != NULL) {
+        fprintf(vm->errors, "Only one heap image can be loaded.\n");
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(vm->errors, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        fprintf(vm->errors, "\"%s\" is not a heap image.\n", path);
+        return false;
+    }
+
+    // private and writable, since the strings' next fields may be used below
+    void* mapping = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(vm->errors, "Could not map file \"%s\".\n", path);
+        return false;
+    }
+
+    ImageHeader* header = (ImageHeader*)mapping;
+    const char* problem = NULL;
+    if (header->magic != IMAGE_MAGIC) {
+        problem = "is not a heap image";
+    } else if (header->version != IMAGE_VERSION || header->valueSize != sizeof(Value)
+            || header->hashCheck != hashString(HASH_CHECK_KEY, (int)strlen(HASH_CHECK_KEY))) {
+        problem = "was saved by another version or build of clox";
+    } else if (header->stringsSize > (size_t)status.st_size - sizeof(ImageHeader)
+            || (size_t)header->globalCount * sizeof(ImageGlobal)
+                > (size_t)status.st_size - sizeof(ImageHeader) - header->stringsSize) {
+        problem = "is truncated";
+    }
+    if (problem != NULL) {
+        fprintf(vm->errors, "\"%s\" %s.\n", path, problem);
+        munmap(mapping, status.st_size);
+        return false;
+    }
+    vm->image = mapping;
+    vm->imageSize = status.st_size;
+
+    // everything the image holds stays alive, so a collection started by the
+    // tables growing below would only find nothing to free
+    size_t nextGC = vm->nextGC;
+    vm->nextGC = SIZE_MAX;
+
+    // the strings are interned first. Where the VM already has a copy of one,
+    // the image string's next field, otherwise unused, forwards to the copy;
+    // the others are left alone, so their pages stay clean
+    uint8_t* strings = (uint8_t*)mapping + sizeof(ImageHeader);
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        ObjString* string = (ObjString*)(strings + offset);
+        ObjString* adopted = adoptString(vm, string);
+        if (adopted != string) {
+            string->obj.next = (Obj*)adopted;
+        }
+        offset += ALIGN_IMAGE(stringSize(string->length));
+    }
+
+    ImageGlobal* globals = (ImageGlobal*)(strings + header->stringsSize);
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        int slot = globalSlot(vm, resolveString(strings, globals[i].name));
+        // nothing allocates from here on, so a string of the VM's own that
+        // only this global will hold can't be collected before it does
+        Value value = globals[i].value;
+        if (IS_OBJ(value)) {
+            value = OBJ_VAL(resolveString(strings, (uintptr_t)AS_OBJ(value)));
+        }
+        vm->globalValues.values[slot] = value;
+    }
+
+    // the next collection waits for the heap to grow as if one had just run
+    if (vm->bytesAllocated * GC_HEAP_GROW_FACTOR > nextGC) {
+        nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    }
+    vm->nextGC = nextGC;
+    return true;
+}
+
+// The image's strings are interned in the VM, so it is only unmapped when the
+// VM is freed.
+void freeImage(VM* vm) {
+    if (vm->image != NULL) {
+        munmap(vm->image, vm->imageSize);
+        vm->image = NULL;
+        vm->imageSize = 0;
+    }
+}
+
+// Gives the string the next offset in the strings section, the first time it
+// is seen.
+static void placeString(VM* vm, Table* offsets, ObjString** strings, uint32_t* count, uint64_t* size, ObjString* string) {
+    Value offset;
+    if (tableGet(offsets, string, &offset)) {
+        return;
+    }
+
+    tableSet(vm, offsets, string, NUMBER_VAL((double)*size));
+    strings[(*count)++] = string;
+    *size += ALIGN_IMAGE(stringSize(string->length));
+}
+
+static uint64_t stringOffset(Table* offsets, ObjString* string) {
+    Value offset;
+    tableGet(offsets, string, &offset);
+    return (uint64_t)AS_NUMBER(offset);
+}
+
+static void writeImageString(FILE* file, ObjString* string) {
+    static const uint8_t zeros[8] = { 0 };
+    ObjString header;
+    memset(&header, 0, sizeof(header));
+    header.obj.type = OBJ_STRING;
+    header.obj.isMarked = true;
+    header.obj.next = NULL;
+    header.length = string->length;
+    header.hash = string->hash;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(string->chars, 1, string->length + 1, file);
+
+    size_t size = stringSize(string->length);
+    fwrite(zeros, 1, ALIGN_IMAGE(size) - size, file);
+}
+
+static ObjString* resolveString(uint8_t* strings, uint64_t offset) {
+    ObjString* string = (ObjString*)(strings + offset);
+    return string->obj.next != NULL ? (ObjString*)string->obj.next : string;
+}
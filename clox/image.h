@@ -0,0 +1,16 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+#include "vm.h"
+
+// A heap image is the global variables of a VM and the strings they hold, saved
+// after a script has set them up, so that later runs can start from them
+// instead of running the script again. The strings are used straight from a
+// private memory mapping of the file, like the code of a bytecode file; only
+// the global variables and the interning table are rebuilt when it is loaded.
+bool saveImage(VM* vm, const char* path);
+bool loadImage(VM* vm, const char* path);
+void freeImage(VM* vm);
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+#define POOL_MIN_CAPACITY 1024
+#define POOL_MAX_LOAD(capacity) ((capacity) / 2)
+
+// An open-addressed table with linear probing, whose slots only ever go from
+// empty to a string. Moving it to a bigger table freezes its empty slots, and
+// whoever runs into a frozen slot carries on in the next table: the strings
+// in the rest of the probe sequence can only be there.
+typedef struct PoolTable {
+    int capacity; // a power of two
+    atomic_int count;
+    _Atomic(struct PoolTable*) next; // the bigger table, once moving has started
+    atomic_bool moved; // every string is in next as well
+    _Atomic(ObjString*) slots[];
+} PoolTable;
+
+static PoolTable* currentTable();
+static PoolTable* allocateTable(int capacity);
+static PoolTable* nextTable(PoolTable* table);
+static ObjString* insert(PoolTable* table, const char* chars, int length, uint32_t hash, ObjString* moving);
+static void moveTable(PoolTable* table);
+static void advanceCurrent(PoolTable* table);
+static ObjString* allocateSharedString(const char* chars, int length, uint32_t hash);
+static bool isString(ObjString* string, const char* chars, int length, uint32_t hash);
+
+// an empty slot that takes no more strings, because its table is being moved
+static Obj frozenSlot;
+#define FROZEN ((ObjString*)&frozenSlot)
+
+// the table lookups start at, which may lag behind while tables are moved
+static _Atomic(PoolTable*) current;
+// the first table, so that the chain of them can be freed
+static _Atomic(PoolTable*) first;
+
+ObjString* findSharedString(const char* chars, int length, uint32_t hash) {
+    PoolTable* table = atomic_load_explicit(&current, memory_order_acquire);
+    while (table != NULL) {
+        uint32_t mask = table->capacity - 1;
+        uint32_t index = hash & mask;
+        for (int probes = 0; probes < table->capacity; probes++) {
+            ObjString* string = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+            if (string == NULL) {
+                return NULL;
+            }
+            if (string == FROZEN) {
+                break;
+            }
+            if (isString(string, chars, length, hash)) {
+                return string;
+            }
+            index = (index + 1) & mask;
+        }
+        table = atomic_load_explicit(&table->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+// Returns the pool's copy of the characters, copying them into the pool if
+// they aren't there yet.
+ObjString* internSharedString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = findSharedString(chars, length, hash);
+    if (string != NULL) {
+        return string;
+    }
+    return insert(currentTable(), chars, length, hash, NULL);
+}
+
+int sharedStringCount() {
+    PoolTable* table = atomic_load(&current);
+    if (table == NULL) {
+        return 0;
+    }
+    while (atomic_load(&table->next) != NULL) {
+        table = atomic_load(&table->next);
+    }
+    return atomic_load(&table->count);
+}
+
+// Only safe once no other thread uses the pool. The last table holds every
+// string, the ones before it are just the tables it was moved from.
+void freeSharedStrings() {
+    PoolTable* table = atomic_load(&first);
+    while (table != NULL) {
+        PoolTable* next = atomic_load(&table->next);
+        if (next == NULL) {
+            for (int i = 0; i < table->capacity; i++) {
+                ObjString* string = atomic_load(&table->slots[i]);
+                if (string != NULL && string != FROZEN) {
+                    free(string);
+                }
+            }
+        }
+        free(table);
+        table = next;
+    }
+    atomic_store(&current, NULL);
+    atomic_store(&first, NULL);
+}
+
+// the table to insert into, made by the first thread to ask for one
+static PoolTable* currentTable() {
+    PoolTable* table = atomic_load_explicit(&current, memory_order_acquire);
+    if (table != NULL) {
+        return table;
+    }
+
+    PoolTable* created = allocateTable(POOL_MIN_CAPACITY);
+    if (atomic_compare_exchange_strong(&current, &table, created)) {
+        atomic_store(&first, created);
+        return created;
+    }
+    free(created); // another thread got there first, and table is now its one
+    return table;
+}
+
+static PoolTable* allocateTable(int capacity) {
+    PoolTable* table = malloc(sizeof(PoolTable) + sizeof(_Atomic(ObjString*)) * capacity);
+    if (table == NULL) {
+        exit(1);
+    }
+    table->capacity = capacity;
+    atomic_init(&table->count, 0);
+    atomic_init(&table->next, NULL);
+    atomic_init(&table->moved, false);
+    for (int i = 0; i < capacity; i++) {
+        atomic_init(&table->slots[i], NULL);
+    }
+    return table;
+}
+
+// Waits for the table that comes after a full one. Only an insert that finds
+// no empty slot at all waits, and the thread that filled the table past its
+// load is about to publish the next one.
+static PoolTable* nextTable(PoolTable* table) {
+    PoolTable* next;
+    while ((next = atomic_load_explicit(&table->next, memory_order_acquire)) == NULL) {
+    }
+    return next;
+}
+
+// Adds a string with the given characters, or returns the one that is already
+// there. A new string is only allocated once an empty slot turns up, and
+// moving a table passes in the string it moves.
+static ObjString* insert(PoolTable* table, const char* chars, int length, uint32_t hash, ObjString* moving) {
+    ObjString* string = moving;
+    for (;;) {
+        uint32_t mask = table->capacity - 1;
+        uint32_t index = hash & mask;
+        int probes = 0;
+        while (probes < table->capacity) {
+            ObjString* slot = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+            if (slot == NULL) {
+                if (string == NULL) {
+                    string = allocateSharedString(chars, length, hash);
+                }
+                if (atomic_compare_exchange_strong_explicit(&table->slots[index], &slot, string,
+                                                            memory_order_acq_rel, memory_order_acquire)) {
+                    if (atomic_fetch_add(&table->count, 1) + 1 > POOL_MAX_LOAD(table->capacity)) {
+                        moveTable(table);
+                    }
+                    return string;
+                }
+                // slot now holds what another thread put there first
+            }
+            if (slot == FROZEN) {
+                break;
+            }
+            if (isString(slot, chars, length, hash)) {
+                if (string != moving) {
+                    free(string); // lost the race for these characters
+                }
+                return slot;
+            }
+            index = (index + 1) & mask;
+            probes++;
+        }
+        table = nextTable(table);
+    }
+}
+
+// Copies a table into one twice its size. The thread that publishes the next
+// table does the copying alone; the others insert into the next table as soon
+// as they run into a frozen slot, and look up through it the same way.
+static void moveTable(PoolTable* table) {
+    PoolTable* next = allocateTable(table->capacity * 2);
+    PoolTable* expected = NULL;
+    if (!atomic_compare_exchange_strong(&table->next, &expected, next)) {
+        free(next); // another thread is already moving it
+        return;
+    }
+
+    for (int i = 0; i < table->capacity; i++) {
+        ObjString* string = NULL;
+        if (atomic_compare_exchange_strong(&table->slots[i], &string, FROZEN)) {
+            continue;
+        }
+        insert(next, string->chars, string->length, string->hash, string);
+    }
+
+    atomic_store(&table->moved, true);
+    advanceCurrent(table);
+}
+
+// Points lookups past a table that has been moved. If current is still on an
+// older table, whoever is moving that one advances past this one as well.
+static void advanceCurrent(PoolTable* table) {
+    while (atomic_load(&table->moved)) {
+        PoolTable* expected = table;
+        PoolTable* next = atomic_load(&table->next);
+        if (!atomic_compare_exchange_strong(&current, &expected, next)) {
+            return;
+        }
+        table = next;
+    }
+}
+
+// Shared strings are marked from the start, so that the collectors of the VMs
+// that use them leave them alone.
+static ObjString* allocateSharedString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = malloc(stringSize(length));
+    if (string == NULL) {
+        exit(1);
+    }
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = true;
+    string->obj.next = NULL;
+    string->length = length;
+    string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+static bool isString(ObjString* string, const char* chars, int length, uint32_t hash) {
+    return string->hash == hash && string->length == length
+        && memcmp(string->chars, chars, length) == 0;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+// One set of interned strings for the whole process, which every thread can
+// read and add to without taking a lock. Its strings are never freed before
+// freeSharedStrings(), live outside every VM's heap and are always marked, so
+// no collector touches them. Lookups never wait; an insert claims an empty slot
+// with a compare-and-swap, and a full table is moved to a bigger one while the
+// other threads keep going.
+ObjString* findSharedString(const char* chars, int length, uint32_t hash);
+ObjString* internSharedString(const char* chars, int length, uint32_t hash);
+int sharedStringCount();
+void freeSharedStrings();
+
+#endif
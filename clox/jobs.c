@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jobs.h"
+#include "script.h"
+#include "vm.h"
+
+typedef struct {
+    const char* path;
+    char* output; // what the script printed, filled in by open_memstream()
+    size_t outputLength;
+    char* errors;
+    size_t errorsLength;
+    int status;
+    double seconds;
+    bool done; // guarded by the pool's lock
+} Job;
+
+// The workers take the next job off a shared counter, so a slow script only
+// holds up its own worker. Results are written out in order as soon as every
+// job before them is done.
+typedef struct {
+    Job* jobs;
+    int count;
+    int optimizationLevel;
+    atomic_int next;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Pool;
+
+static void* work(void* argument);
+static void runJob(Pool* pool, VM* vm, Job* job);
+static void reportJob(Job* job, int index, int count);
+
+int runJobs(const char** paths, int count, int workers, int optimizationLevel) {
+    if (workers > count) {
+        workers = count;
+    }
+
+    Pool pool;
+    pool.jobs = calloc(count, sizeof(Job));
+    if (pool.jobs == NULL) {
+        exit(1);
+    }
+    pool.count = count;
+    pool.optimizationLevel = optimizationLevel;
+    atomic_init(&pool.next, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+    for (int i = 0; i < count; i++) {
+        pool.jobs[i].path = paths[i];
+    }
+
+    double start = now();
+    pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+    if (threads == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, work, &pool);
+    }
+
+    int status = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        Job* job = &pool.jobs[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done) {
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        reportJob(job, i, count);
+        if (job->status != 0) {
+            failed++;
+            if (status == 0) {
+                status = job->status;
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    fprintf(stderr, "%d scripts, %d failed, %.3f s on %d workers, %.1f scripts/s\n",
+            count, failed, elapsed, workers, count / elapsed);
+
+    free(threads);
+    free(pool.jobs);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.finished);
+    return status;
+}
+
+// Each worker keeps one VM struct, but every script gets a fresh heap and
+// fresh globals in it, so scripts can't see each other.
+static void* work(void* argument) {
+    Pool* pool = argument;
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+
+    for (;;) {
+        int index = atomic_fetch_add(&pool->next, 1);
+        if (index >= pool->count) {
+            break;
+        }
+        runJob(pool, vm, &pool->jobs[index]);
+    }
+
+    free(vm);
+    return NULL;
+}
+
+static void runJob(Pool* pool, VM* vm, Job* job) {
+    double start = now();
+    initVM(vm);
+    vm->optimizationLevel = pool->optimizationLevel;
+    vm->output = openCapture(&job->output, &job->outputLength);
+    vm->errors = openCapture(&job->errors, &job->errorsLength);
+
+    job->status = runScript(vm, job->path);
+
+    fclose(vm->output);
+    fclose(vm->errors);
+    freeVM(vm);
+    job->seconds = now() - start;
+
+    pthread_mutex_lock(&pool->lock);
+    job->done = true;
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Writes out what the script printed, then its errors and how it went.
+static void reportJob(Job* job, int index, int count) {
+    fwrite(job->output, 1, job->outputLength, stdout);
+    fflush(stdout);
+    fwrite(job->errors, 1, job->errorsLength, stderr);
+    if (job->status == 0) {
+        fprintf(stderr, "[%d/%d] %s: ok, %.3f s\n", index + 1, count, job->path, job->seconds);
+    } else {
+        fprintf(stderr, "[%d/%d] %s: exit %d, %.3f s\n", index + 1, count, job->path, job->status, job->seconds);
+    }
+
+    free(job->output);
+    free(job->errors);
+    job->output = NULL;
+    job->errors = NULL;
+}
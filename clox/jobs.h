@@ -0,0 +1,10 @@
+#ifndef clox_jobs_h
+#define clox_jobs_h
+
+// Runs the scripts on a pool of worker threads, each with a VM of its own, and
+// returns the status of the first one that failed, or 0. Each script's output
+// and errors are captured, and written out in the order the scripts were
+// given, along with a line per script on stderr.
+int runJobs(const char** paths, int count, int workers, int optimizationLevel);
+
+#endif
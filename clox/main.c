@@ -2,32 +2,135 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "intern.h"
+#include "jobs.h"
+#include "prefork.h"
+#include "script.h"
+#include "serve.h"
 #include "vm.h"
 
-static void repl();
-static void runFile(const char* path);
-static char* readFile(const char* path);
+static void usage();
+static void repl(VM* vm);
+static void compileFile(VM* vm, const char* path, const char* output);
+static int connectFile(const char* socketPath, const char* path);
+static int runWithImages(VM* vm, const char* path, const char* imagePath, const char* dumpPath);
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    VM vm;
+    initVM(&vm);
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    const char* path = NULL;
+    const char* output = NULL;
+    bool compileOnly = false;
+    int jobs = 0;
+    const char* servePath = NULL;
+    const char* connectPath = NULL;
+    const char* imagePath = NULL;
+    const char* dumpPath = NULL;
+    const char* preludePath = NULL;
+    const char** paths = malloc(sizeof(const char*) * argc);
+    int pathCount = 0;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-O0") == 0) {
+            vm.optimizationLevel = 0;
+        } else if (strcmp(argv[arg], "-O1") == 0) {
+            vm.optimizationLevel = 1;
+        } else if (strcmp(argv[arg], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            output = argv[++arg];
+        } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            jobs = atoi(argv[++arg]);
+            if (jobs < 1) {
+                usage();
+            }
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+            servePath = argv[++arg];
+        } else if (strcmp(argv[arg], "--connect") == 0 && arg + 1 < argc) {
+            connectPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc) {
+            imagePath = argv[++arg];
+        } else if (strcmp(argv[arg], "--dump-image") == 0 && arg + 1 < argc) {
+            dumpPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--prefork") == 0 && arg + 1 < argc) {
+            preludePath = argv[++arg];
+        } else if (argv[arg][0] == '-') {
+            usage();
+        } else {
+            path = argv[arg];
+            paths[pathCount++] = path;
+        }
+    }
+
+    bool images = imagePath != NULL || dumpPath != NULL;
+    int status = 0;
+    if (images && (preludePath != NULL || servePath != NULL || connectPath != NULL || jobs > 0 || compileOnly)) {
+        usage();
+    } else if (preludePath != NULL) {
+        if (compileOnly || output != NULL || servePath != NULL || connectPath != NULL || pathCount == 0) {
+            usage();
+        }
+        status = runPrefork(&vm, preludePath, paths, pathCount, jobs > 0 ? jobs : pathCount);
+    } else if (servePath != NULL) {
+        if (compileOnly || output != NULL || connectPath != NULL || pathCount > 0) {
+            usage();
+        }
+        status = serve(servePath, jobs > 0 ? jobs : 1, vm.optimizationLevel);
+    } else if (connectPath != NULL) {
+        if (compileOnly || output != NULL || jobs > 0 || pathCount != 1) {
+            usage();
+        }
+        status = connectFile(connectPath, path);
+    } else if (jobs > 0) {
+        if (compileOnly || output != NULL || pathCount == 0) {
+            usage();
+        }
+        status = runJobs(paths, pathCount, jobs, vm.optimizationLevel);
+    } else if (pathCount > 1) {
+        usage();
+    } else if (compileOnly) {
+        if (path == NULL) {
+            usage();
+        }
+        compileFile(&vm, path, output);
+    } else if (output != NULL) {
+        usage();
+    } else if (path == NULL) {
+        if (dumpPath != NULL) {
+            usage();
+        }
+        if (imagePath != NULL && !loadImage(&vm, imagePath)) {
+            status = EXIT_IO_ERROR;
+        } else {
+            repl(&vm);
+        }
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runWithImages(&vm, path, imagePath, dumpPath);
     }
 
-    freeVM();
-    return 0;
+    free(paths);
+    freeVM(&vm);
+    freeSharedStrings();
+    return status;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O0|-O1] [--image image] [--dump-image image] [path]\n");
+    fprintf(stderr, "       clox [-O0|-O1] --compile path [-o output]\n");
+    fprintf(stderr, "       clox [-O0|-O1] --jobs workers path...\n");
+    fprintf(stderr, "       clox [-O0|-O1] --prefork prelude [--jobs workers] path...\n");
+    fprintf(stderr, "       clox [-O0|-O1] --serve socket [--jobs workers]\n");
+    fprintf(stderr, "       clox --connect socket path\n");
+    exit(64);
 }
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -37,49 +140,69 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+// Compiles the file into a bytecode file, by default next to it with a .loxc
+// extension for a .lox file.
+static void compileFile(VM* vm, const char* path, const char* output) {
+    char* defaultOutput = NULL;
+    if (output == NULL) {
+        size_t length = strlen(path);
+        defaultOutput = malloc(length + 2);
+        memcpy(defaultOutput, path, length);
+        memcpy(defaultOutput + length, "c", 2);
+        output = defaultOutput;
+    }
+
+    char* source = readFile(path, stderr);
+    if (source == NULL) {
+        exit(EXIT_IO_ERROR);
+    }
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(vm, source, &chunk)) {
+        exit(EXIT_COMPILE_ERROR);
+    }
 
-    if (result == INTERPRET_COMPILE_ERROR) {
-        exit(65);
+    bool written = writeBytecode(vm, &chunk, source, path, output);
+    if (!written) {
+        fprintf(stderr, "Could not write file \"%s\".\n", output);
     }
-    if (result == INTERPRET_RUNTIME_ERROR) {
-        exit(70);
+
+    freeChunk(vm, &chunk);
+    free(source);
+    free(defaultOutput);
+    if (!written) {
+        exit(EXIT_IO_ERROR);
     }
 }
 
-static char* readFile(const char* path) {
-    // open the file
+// Runs the file on the server listening at socketPath, as if it ran here.
+static int connectFile(const char* socketPath, const char* path) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        return EXIT_IO_ERROR;
     }
 
-    // seek the file to find the size, then rewind
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    int status = sendScript(socketPath, file, stdout, stderr);
+    fclose(file);
+    return status;
+}
 
-    // allocate the buffer and read the file
-    char* buffer = (char*) malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enouogh memory to read \"%s\".\n", path);
-        exit(74);
+// Runs the file, starting from the heap image at imagePath and saving the heap
+// it leaves behind to dumpPath, when they are given.
+static int runWithImages(VM* vm, const char* path, const char* imagePath, const char* dumpPath) {
+    if (imagePath != NULL && !loadImage(vm, imagePath)) {
+        return EXIT_IO_ERROR;
     }
-    size_t byteRead = fread(buffer, sizeof(char), fileSize, file);
-    if (byteRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
-    }
-    buffer[byteRead] = '\0';
 
-    fclose(file);
-    return buffer;
+    int status = runScript(vm, path);
+    if (status == 0 && dumpPath != NULL && !saveImage(vm, dumpPath)) {
+        fprintf(stderr, "Could not write file \"%s\".\n", dumpPath);
+        status = EXIT_IO_ERROR;
+    }
+    return status;
 }
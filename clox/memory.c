@@ -1,41 +1,438 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "allocator.h"
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
-static void freeObject(Obj* object);
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+static void freeObject(VM* vm, Obj* object);
+static void freeList(VM* vm, Obj* object);
+static void markArray(VM* vm, ValueArray* array);
+static void markRoots(VM* vm);
+static void traceReferences(VM* vm);
+static void blackenObject(VM* vm, Obj* object);
+static void sweep(VM* vm);
+#ifdef NURSERY
+static void clearYoungMarks(VM* vm);
+static void promoteValue(VM* vm, Value* value);
+static void promoteField(VM* vm, Obj** field);
+static void promoteReferences(VM* vm, Obj* object);
+static Obj* promote(VM* vm, Obj* object);
+#endif
+static uint64_t now();
+
+// young objects are laid out back to back on 8-byte boundaries
+#define ALIGN_YOUNG(size) (((size) + 7) & ~(size_t)7)
 
 // returns the pointer to the newly allocated memory
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    if (newSize == 0) {
-        free(pointer);
-        return NULL;
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize) {
+        vm->gcStats.bytesRequested += newSize - oldSize;
+        if (pointer == NULL) {
+            vm->gcStats.allocations++;
+        }
+#ifdef DEBUG_STRESS_GC
+        collectGarbage(vm);
+#endif
+        if (vm->bytesAllocated > vm->nextGC) {
+            collectGarbage(vm);
+        }
+    }
+
+    return reallocateBlock(&vm->allocator, pointer, oldSize, newSize);
+}
+
+#ifdef NURSERY
+// Bump-allocates a young object. When the nursery is full its survivors are
+// promoted to the heap first, so young objects held only in C locals move.
+void* allocateYoung(VM* vm, size_t size) {
+    size = ALIGN_YOUNG(size);
+#ifdef DEBUG_STRESS_GC
+    collectYoung(vm);
+#endif
+    if (vm->nurseryTop + size > vm->nursery + NURSERY_SIZE) {
+        collectYoung(vm);
+    }
+
+    void* object = vm->nurseryTop;
+    vm->nurseryTop += size;
+    vm->gcStats.bytesRequested += size;
+    vm->gcStats.allocations++;
+    return object;
+}
+
+// Hands back the most recent young allocation.
+void releaseYoung(VM* vm, void* pointer, size_t size) {
+    if ((uint8_t*)pointer + ALIGN_YOUNG(size) == vm->nurseryTop) {
+        vm->nurseryTop = pointer;
+        vm->gcStats.bytesRequested -= ALIGN_YOUNG(size);
+        vm->gcStats.allocations--;
+    }
+}
+
+bool isYoung(VM* vm, Obj* object) {
+    return (uint8_t*)object >= vm->nursery && (uint8_t*)object < vm->nursery + NURSERY_SIZE;
+}
+
+// Records an old object that refers to young ones, so that the next minor
+// collection can update it. Only ropes do that. The set is grown with
+// realloc() directly, like the gray stack, so recording can't start a
+// collection.
+void rememberObject(VM* vm, Obj* object) {
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+        if (vm->remembered == NULL) {
+            exit(1);
+        }
+    }
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+// A minor collection copies the young objects that are still reachable to the
+// heap and empties the nursery. Only concatenate() and flattenRope() create
+// young strings, and they can only end up on the stack, in global variables,
+// in vm->strings and in the ropes of the remembered set, so those are the only
+// places that are scanned. No other old object refers to a young one.
+void collectYoung(VM* vm) {
+    uint64_t start = now();
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+#endif
+
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        promoteValue(vm, slot);
+    }
+    for (int i = 0; i < vm->globalValues.count; i++) {
+        promoteValue(vm, &vm->globalValues.values[i]);
+    }
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        promoteReferences(vm, vm->remembered[i]);
+    }
+    vm->rememberedCount = 0; // nothing old refers to a young object any more
+
+    // every young string is interned, and the interning table is weak:
+    // promoted strings are moved to their copy, the rest are dropped
+    uint8_t* object = vm->nursery;
+    while (object < vm->nurseryTop) {
+        ObjString* string = (ObjString*)object;
+        if (string->obj.isMarked) {
+            tableRekey(&vm->strings, string, (ObjString*)string->obj.next);
+        } else {
+            tableDelete(vm, &vm->strings, string);
+        }
+        object += ALIGN_YOUNG(stringSize(string->length));
     }
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) {
-        exit(1);
+    vm->nurseryTop = vm->nursery;
+
+    uint64_t pause = now() - start;
+    vm->gcStats.minorCollections++;
+    vm->gcStats.minorPauseNs += pause;
+    if (pause > vm->gcStats.maxMinorPauseNs) {
+        vm->gcStats.maxMinorPauseNs = pause;
+    }
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+#endif
+
+    // promotion grew the heap without going through reallocate()
+    if (vm->bytesAllocated > vm->nextGC) {
+        collectGarbage(vm);
+    }
+}
+#endif
+
+void markObject(VM* vm, Obj* object) {
+    if (object == NULL || object->isMarked) {
+        return;
+    }
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(stdout, OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = true;
+
+    // the gray stack is allocated with realloc() directly, so growing it can't
+    // start another collection
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL) {
+            exit(1);
+        }
+    }
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM* vm, Value value) {
+    if (IS_OBJ(value)) {
+        markObject(vm, AS_OBJ(value));
+    }
+}
+
+// A major collection never moves young objects: they are marked like the rest
+// (so the strings table keeps the live ones), but only old objects are swept.
+void collectGarbage(VM* vm) {
+    uint64_t start = now();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    markRoots(vm);
+    traceReferences(vm);
+    // interned strings are weak references: the table mustn't keep them alive
+    tableRemoveWhite(&vm->strings);
+    sweep(vm);
+#ifdef NURSERY
+    clearYoungMarks(vm);
+#endif
+
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+    uint64_t pause = now() - start;
+    vm->gcStats.majorCollections++;
+    vm->gcStats.majorPauseNs += pause;
+    if (pause > vm->gcStats.maxMajorPauseNs) {
+        vm->gcStats.maxMajorPauseNs = pause;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+            before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+// Makes every object that is alive now permanent, so that processes forked
+// afterwards keep sharing the pages the objects are on. The objects are marked
+// for good and moved to vm->frozen, which no collection walks, so neither
+// marking nor sweeping writes to their headers again; new blocks come from
+// new slabs. Global ropes are flattened first and dropped, since flattening
+// writes to a rope and nothing would trace the string a frozen rope got.
+void freezeHeap(VM* vm) {
+    for (int i = 0; i < vm->globalValues.count; i++) {
+        if (IS_ROPE(vm->globalValues.values[i])) {
+            ObjString* flat = flattenRope(vm, AS_ROPE(vm->globalValues.values[i]));
+            vm->globalValues.values[i] = OBJ_VAL(flat);
+        }
+    }
+#ifdef NURSERY
+    collectYoung(vm);
+#endif
+    collectGarbage(vm);
+
+    Obj* last = NULL;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        object->isMarked = true;
+        last = object;
+    }
+    if (last != NULL) {
+        last->next = vm->frozen;
+        vm->frozen = vm->objects;
+        vm->objects = NULL;
     }
+    sealAllocator(&vm->allocator);
+}
+
+// Frees every object and empties the nursery, but keeps the gray stack and the
+// remembered set, so the VM can go on allocating.
+void freeHeap(VM* vm) {
+    freeList(vm, vm->objects);
+    freeList(vm, vm->frozen);
+    vm->objects = NULL;
+    vm->frozen = NULL;
+#ifdef NURSERY
+    vm->nurseryTop = vm->nursery;
+    vm->rememberedCount = 0;
+#endif
+}
 
-    return result;
+void freeObjects(VM* vm) {
+    freeHeap(vm);
+    free(vm->grayStack);
+#ifdef NURSERY
+    free(vm->remembered);
+#endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+static void freeList(VM* vm, Obj* object) {
     while (object != NULL) {
         Obj* next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
 }
 
-static void freeObject(Obj* object) {
+static void markArray(VM* vm, ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        markValue(vm, array->values[i]);
+    }
+}
+
+// The roots are the stack, the globals, the remembered set and the constants
+// of the chunk that is running or being compiled or loaded.
+static void markRoots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
+#ifdef NURSERY
+    // the remembered set holds on to its objects until the next minor collection
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        markObject(vm, vm->remembered[i]);
+    }
+#endif
+    if (vm->chunk != NULL) {
+        markArray(vm, &vm->chunk->constants);
+    }
+    markCompilerRoots(vm);
+}
+
+static void traceReferences(VM* vm) {
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+    }
+}
+
+// Marks everything the object refers to.
+static void blackenObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(stdout, OBJ_VAL(object));
+    printf("\n");
+#endif
     switch (object->type) {
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*)rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+            // strings don't refer to anything
             break;
+    }
+}
+
+static void sweep(VM* vm) {
+    Obj* previous = NULL;
+    Obj* object = vm->objects;
+    while (object != NULL) {
+        if (object->isMarked) {
+            // clear the mark for the next cycle
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+            continue;
         }
+
+        // unlink the unreached object and free it
+        Obj* unreached = object;
+        object = object->next;
+        if (previous != NULL) {
+            previous->next = object;
+        } else {
+            vm->objects = object;
+        }
+        freeObject(vm, unreached);
+    }
+}
+
+#ifdef NURSERY
+// Young objects are only ever strings, so the nursery can be walked object by
+// object. Their marks must be clear again, since a minor collection uses the
+// mark as the "already promoted" flag.
+static void clearYoungMarks(VM* vm) {
+    uint8_t* object = vm->nursery;
+    while (object < vm->nurseryTop) {
+        ObjString* string = (ObjString*)object;
+        string->obj.isMarked = false;
+        object += ALIGN_YOUNG(stringSize(string->length));
+    }
+}
+
+static void promoteValue(VM* vm, Value* value) {
+    if (IS_OBJ(*value) && isYoung(vm, AS_OBJ(*value))) {
+        *value = OBJ_VAL(promote(vm, AS_OBJ(*value)));
+    }
+}
+
+static void promoteField(VM* vm, Obj** field) {
+    if (*field != NULL && isYoung(vm, *field)) {
+        *field = promote(vm, *field);
+    }
+}
+
+static void promoteReferences(VM* vm, Obj* object) {
+    switch (object->type) {
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            promoteField(vm, &rope->left);
+            promoteField(vm, &rope->right);
+            promoteField(vm, (Obj**)&rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+            break;
+    }
+}
+
+// Copies a young object to the heap, or returns its copy if it has been
+// promoted already. The old location keeps the address of the copy in next.
+static Obj* promote(VM* vm, Obj* object) {
+    if (object->isMarked) {
+        return object->next;
+    }
+
+    // allocated without reallocate(), since a major collection mustn't start
+    // halfway through a minor one
+    size_t size = stringSize(((ObjString*)object)->length);
+    ObjString* string = reallocateBlock(&vm->allocator, NULL, 0, size);
+    memcpy(string, object, size);
+    string->obj.next = vm->objects;
+    vm->objects = (Obj*)string;
+
+    vm->bytesAllocated += size;
+    vm->gcStats.allocations++;
+    vm->gcStats.promotedBytes += size;
+
+    object->isMarked = true;
+    object->next = (Obj*)string;
+    return (Obj*)string;
+}
+#endif
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void freeObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+    switch (object->type) {
+        case OBJ_ROPE:
+            FREE(vm, ObjRope, object);
+            break;
+        case OBJ_STRING:
+            reallocate(vm, object, stringSize(((ObjString*)object)->length), 0);
+            break;
     }
 }
@@ -5,23 +5,48 @@
 #include "object.h"
 
 // allocates an array with a given element type and count; returns the pointer
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) \
+    reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*) reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*) reallocate(vm, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+// the heap may grow to this multiple of what survived a collection before the
+// next one starts
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
 
+#ifdef NURSERY
+// the young generation; objects bigger than NURSERY_MAX_OBJECT go straight to the heap
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+#endif
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+#ifdef NURSERY
+void* allocateYoung(VM* vm, size_t size);
+void releaseYoung(VM* vm, void* pointer, size_t size);
+bool isYoung(VM* vm, Obj* object);
+void rememberObject(VM* vm, Obj* object);
+void collectYoung(VM* vm);
+#endif
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+void collectGarbage(VM* vm);
+void freezeHeap(VM* vm);
+void freeHeap(VM* vm);
+void freeObjects(VM* vm);
 #endif
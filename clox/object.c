@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -8,71 +11,288 @@
 #include "vm.h"
 
 // allocate the memory for Obj, and any other additional fiels for the type
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType);
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType);
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash);
-static Obj* allocateObject(size_t size, ObjType type);
-static uint32_t hashString(const char* key, int length);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type);
+static ObjString* allocateString(VM* vm, int length);
+static void initString(ObjString* string, int length);
+static ObjString* addString(VM* vm, ObjString* string, uint32_t hash);
+static ObjString* findString(VM* vm, const char* chars, int length, uint32_t hash);
+static Obj* ropePiece(Obj* object);
+static void walkRope(ObjRope* rope, void (*visit)(ObjString* piece, void* context), void* context);
+static void appendPiece(ObjString* piece, void* context);
+static void printPiece(ObjString* piece, void* context);
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
     if (interned != NULL) {
         return interned;
     }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(vm, length);
+    memcpy(string->chars, chars, length);
+    return addString(vm, string, hash);
 }
 
-ObjString* takeString(char* chars, int length) {
+// Like copyString(), for identifiers and string literals: with SHARED_STRINGS,
+// characters no VM of the process has interned yet go to the shared pool
+// instead of this VM's heap, unless the VM doesn't share its strings.
+ObjString* copySharedString(VM* vm, const char* chars, int length) {
+#ifdef SHARED_STRINGS
+    if (!vm->shareStrings) {
+        return copyString(vm, chars, length);
+    }
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
+    if (interned != NULL) {
+        return interned;
+    }
+    return internSharedString(chars, length, hash);
+#else
+    return copyString(vm, chars, length);
+#endif
+}
+
+// Returns a string with room for length characters, which the caller fills in
+// and then passes to internString(). The string is young if it fits in the
+// nursery. Allocating can start a collection, and a minor one moves the other
+// young strings.
+ObjString* newString(VM* vm, int length) {
+#ifdef NURSERY
+    size_t size = stringSize(length);
+    if (size <= NURSERY_MAX_OBJECT) {
+        ObjString* string = (ObjString*)allocateYoung(vm, size);
+        initString(string, length);
+        return string;
+    }
+#endif
+    return allocateString(vm, length);
+}
+
+// Returns the interned copy of a string from newString() if there is one (the
+// new string is then freed), otherwise interns the new string itself.
+ObjString* internString(VM* vm, ObjString* string) {
+    uint32_t hash = hashString(string->chars, string->length);
+
+    ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, hash);
+#ifdef SHARED_STRINGS
+    if (interned == NULL) {
+        interned = findSharedString(string->chars, string->length, hash);
+    }
+#endif
+    if (interned != NULL) {
+#ifdef NURSERY
+        if (isYoung(vm, (Obj*)string)) {
+            releaseYoung(vm, string, stringSize(string->length));
+            return interned;
+        }
+#endif
+        reallocate(vm, string, stringSize(string->length), 0);
+        return interned;
+    }
+
+#ifdef NURSERY
+    if (isYoung(vm, (Obj*)string)) {
+        // a major collection started by growing the table doesn't move young objects
+        string->hash = hash;
+        tableSet(vm, &vm->strings, string, NIL_VAL);
+        return string;
+    }
+#endif
+    return addString(vm, string, hash);
+}
+
+// Interns a string that lives outside the heap, such as one mapped from a heap
+// image, and returns the string the VM is to use for its characters: a copy it
+// already has, or else the string itself. The string must be marked from the
+// start, like a shared one, so that the collectors leave it alone.
+ObjString* adoptString(VM* vm, ObjString* string) {
+    ObjString* interned = findString(vm, string->chars, string->length, string->hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    return string;
+}
+
+// Joins two strings or ropes without copying them. Their lengths must add up to
+// no more than INT_MAX, and both must stay reachable until it returns.
+// Allocating on the heap never starts a minor collection, so they don't move in
+// the meantime.
+ObjRope* newRope(VM* vm, Obj* left, Obj* right) {
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = stringLength(left) + stringLength(right);
+    rope->left = ropePiece(left);
+    rope->right = ropePiece(right);
+    rope->flat = NULL;
+#ifdef NURSERY
+    if (isYoung(vm, rope->left) || isYoung(vm, rope->right)) {
+        rememberObject(vm, (Obj*)rope);
+    }
+#endif
+    return rope;
+}
+
+// Returns the interned string with the rope's characters, building it the
+// first time. The rope must stay reachable until it returns.
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+    if (rope->flat != NULL) {
+        return rope->flat;
+    }
+
+    // a minor collection started here moves young pieces, but the remembered
+    // set keeps the rope pointing at them
+    ObjString* string = newString(vm, rope->length);
+    char* end = string->chars;
+    walkRope(rope, appendPiece, &end);
+
+    rope->flat = internString(vm, string);
+    rope->left = NULL;
+    rope->right = NULL;
+#ifdef NURSERY
+    if (isYoung(vm, (Obj*)rope->flat)) {
+        rememberObject(vm, (Obj*)rope);
+    }
+#endif
+    return rope->flat;
 }
 
-void printObject(Value value) {
+void printObject(FILE* file, Value value) {
     switch (OBJ_TYPE(value)) {
+        case OBJ_ROPE:
+            // printing a rope doesn't flatten it, so the collector can log ropes
+            walkRope(AS_ROPE(value), printPiece, file);
+            break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fprintf(file, "%s", AS_CSTRING(value));
             break;
     }
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->chars = chars;
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+    object->type = type;
+    object->isMarked = false;
+    object->next = vm->objects; // insert at the head of the list
+    vm->objects = object; // reset head
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
+
+    return object;
+}
+
+// The characters follow the header in the same block. The string isn't on
+// the VM's objects until addString() puts it there, so a duplicate of an interned
+// string can be freed right away.
+static ObjString* allocateString(VM* vm, int length) {
+    ObjString* string = (ObjString*)reallocate(vm, NULL, 0, stringSize(length));
+    initString(string, length);
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)string, stringSize(length), OBJ_STRING);
+#endif
+
+    return string;
+}
+
+static void initString(ObjString* string, int length) {
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = false;
+    string->obj.next = NULL;
     string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
+}
+
+// Puts a new heap string on the VM's objects and interns it.
+static ObjString* addString(VM* vm, ObjString* string, uint32_t hash) {
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL); // intern the string
+    string->obj.next = vm->objects; // insert at the head of the list
+    vm->objects = (Obj*)string;
+
+    push(vm, OBJ_VAL(string)); // growing the table can start a collection
+    tableSet(vm, &vm->strings, string, NIL_VAL); // intern the string
+    pop(vm);
     return string;
 }
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->next = vm.objects; // insert at the head of the list
-    vm.objects = object; // reset head
+// Finds the string this VM uses for the characters: one it interned itself,
+// or else the shared one. A VM only interns its own copy when there is no
+// shared one yet, and looks at its own first, so it never sees two copies.
+static ObjString* findString(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+#ifdef NURSERY
+    // the strings found here end up in constant pools and global names,
+    // which minor collections don't scan, so a young match is promoted first
+    if (interned != NULL && isYoung(vm, (Obj*)interned)) {
+        collectYoung(vm);
+        interned = tableFindString(&vm->strings, chars, length, hash);
+    }
+#endif
+#ifdef SHARED_STRINGS
+    if (interned == NULL) {
+        interned = findSharedString(chars, length, hash);
+    }
+#endif
+    return interned;
+}
 
+// A flattened rope stands for its string, so new ropes use the string instead.
+static Obj* ropePiece(Obj* object) {
+    if (object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL) {
+        return (Obj*)((ObjRope*)object)->flat;
+    }
     return object;
 }
 
-// FNV-1a hash function
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+// Calls visit on the strings a rope is made of, from left to right. It keeps
+// its own stack instead of recursing, since a string built one piece at a time
+// is a rope as deep as the number of pieces. Nothing here allocates on the
+// heap, so it is safe to call during a collection.
+static void walkRope(ObjRope* rope, void (*visit)(ObjString* piece, void* context), void* context) {
+    Obj** pending = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    Obj* object = (Obj*)rope;
+    for (;;) {
+        object = ropePiece(object);
+        if (object->type == OBJ_ROPE) {
+            if (capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                pending = (Obj**)realloc(pending, sizeof(Obj*) * capacity);
+                if (pending == NULL) {
+                    exit(1);
+                }
+            }
+            pending[count++] = ((ObjRope*)object)->right;
+            object = ((ObjRope*)object)->left;
+            continue;
+        }
+
+        visit((ObjString*)object, context);
+        if (count == 0) {
+            break;
+        }
+        object = pending[--count];
     }
-    return hash;
+
+    free(pending);
+}
+
+static void appendPiece(ObjString* piece, void* context) {
+    char** end = (char**)context;
+    memcpy(*end, piece->chars, piece->length);
+    *end += piece->length;
+}
+
+static void printPiece(ObjString* piece, void* context) {
+    fwrite(piece->chars, 1, piece->length, (FILE*)context);
 }
@@ -5,30 +5,70 @@
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+// to Lox, a rope is just another string
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
+#ifdef ROPES
+// concatenations at least this long are built as ropes
+#ifndef ROPE_MIN_LENGTH
+#define ROPE_MIN_LENGTH 256
+#endif
+#endif
+
 typedef enum {
+    OBJ_ROPE,
     OBJ_STRING,
 } ObjType;
 
 struct Obj {
     ObjType type;
+    bool isMarked; // reached by the collector in the current cycle
     struct Obj* next; // make objects a linked list
 };
 
+// The characters are stored right after the header, in the same allocation.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
-ObjString* copyString(const char* chars, int length);
-ObjString* takeString(char* chars, int length);
-void printObject(Value value);
+// A concatenation whose characters haven't been copied yet. Flattening gathers
+// them into an interned string, which is kept in flat, and lets go of the
+// halves. Ropes are never young, but their halves may be.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left; // an ObjString or an unflattened ObjRope, NULL once flattened
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjString* copySharedString(VM* vm, const char* chars, int length);
+ObjString* newString(VM* vm, int length);
+ObjString* internString(VM* vm, ObjString* string);
+ObjString* adoptString(VM* vm, ObjString* string);
+ObjRope* newRope(VM* vm, Obj* left, Obj* right);
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+void printObject(FILE* file, Value value);
+
+// the size of a string's block: the header and the characters with their terminator
+static inline size_t stringSize(int length) {
+    return sizeof(ObjString) + length + 1;
+}
+
+// the length of a string or a rope
+static inline int stringLength(Obj* string) {
+    return string->type == OBJ_ROPE ? ((ObjRope*)string)->length : ((ObjString*)string)->length;
+}
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,490 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// The optimizer decodes a finished chunk into a list of instructions, rewrites
+// that list with a peephole pass and encodes it back. Instructions are only
+// ever appended to the output list, so each rule just has to look at the last
+// few instructions that were emitted. Lox has no jumps yet, so there are no
+// offsets to patch when instructions are removed.
+
+typedef struct {
+    uint8_t opcode;
+    int operands[2]; // constant indexes, slots or counts, depending on the opcode
+    int line;
+} Instruction;
+
+typedef struct {
+    int count;
+    int capacity;
+    Instruction* instructions;
+} InstructionArray;
+
+static void initInstructionArray(InstructionArray* array);
+static void freeInstructionArray(VM* vm, InstructionArray* array);
+static void writeInstruction(VM* vm, InstructionArray* array, uint8_t opcode, int operand, int line);
+static void decode(VM* vm, Chunk* chunk, InstructionArray* instructions);
+static void encode(VM* vm, Chunk* chunk, InstructionArray* instructions);
+static void encodeInstruction(VM* vm, Chunk* chunk, uint8_t opcode, int operand, int line);
+static void optimize(VM* vm, Chunk* chunk, InstructionArray* in, InstructionArray* out);
+static bool foldUnary(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction);
+static bool foldBinary(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction);
+static bool foldConcat(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction);
+static bool removeDeadPush(VM* vm, InstructionArray* out, Instruction* instruction);
+static bool fuse(InstructionArray* out, Instruction* instruction);
+static int constantOperand(uint8_t opcode);
+static int longOpcode(uint8_t opcode);
+static int shortOpcode(uint8_t opcode);
+static bool isConstant(Instruction* instruction);
+static bool isPurePush(Instruction* instruction);
+static Value constantValue(Chunk* chunk, Instruction* instruction);
+static void emitValue(VM* vm, Chunk* chunk, InstructionArray* out, Value value, int line);
+static Instruction* last(InstructionArray* out, int distance);
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+    InstructionArray in;
+    InstructionArray out;
+    initInstructionArray(&in);
+    initInstructionArray(&out);
+
+    decode(vm, chunk, &in);
+    optimize(vm, chunk, &in, &out);
+    encode(vm, chunk, &out);
+
+    freeInstructionArray(vm, &in);
+    freeInstructionArray(vm, &out);
+}
+
+static void initInstructionArray(InstructionArray* array) {
+    array->count = 0;
+    array->capacity = 0;
+    array->instructions = NULL;
+}
+
+static void freeInstructionArray(VM* vm, InstructionArray* array) {
+    FREE_ARRAY(vm, Instruction, array->instructions, array->capacity);
+    initInstructionArray(array);
+}
+
+static void writeInstruction(VM* vm, InstructionArray* array, uint8_t opcode, int operand, int line) {
+    if (array->capacity < array->count + 1) {
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->instructions = GROW_ARRAY(vm, Instruction, array->instructions, oldCapacity, array->capacity);
+    }
+
+    Instruction* instruction = &array->instructions[array->count++];
+    instruction->opcode = opcode;
+    instruction->operands[0] = operand;
+    instruction->operands[1] = 0;
+    instruction->line = line;
+}
+
+// The wide forms of instructions are decoded as their one-byte forms, so the
+// rules never have to tell them apart. encode() picks the right form again.
+static void decode(VM* vm, Chunk* chunk, InstructionArray* instructions) {
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t opcode = chunk->code[offset];
+        int size = instructionSize(opcode);
+        int shortForm = shortOpcode(opcode);
+        int line = getLine(chunk, offset);
+        if (shortForm != -1) {
+            writeInstruction(vm, instructions, (uint8_t)shortForm, readLongOperand(chunk, offset + 1), line);
+        } else {
+            writeInstruction(vm, instructions, opcode, 0, line);
+            for (int i = 1; i < size; i++) {
+                instructions->instructions[instructions->count - 1].operands[i - 1] = chunk->code[offset + i];
+            }
+        }
+        offset += size;
+    }
+}
+
+// Replaces the chunk's code with the instructions. The constant pool is
+// rebuilt too, so constants that were folded away are dropped.
+static void encode(VM* vm, Chunk* chunk, InstructionArray* instructions) {
+    Chunk result;
+    initChunk(&result);
+
+    int* constantMap = ALLOCATE(vm, int, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        constantMap[i] = -1;
+    }
+
+    for (int i = 0; i < instructions->count; i++) {
+        Instruction* instruction = &instructions->instructions[i];
+        int operands[2] = { instruction->operands[0], instruction->operands[1] };
+
+        int constant = constantOperand(instruction->opcode);
+        if (constant != -1) {
+            int index = operands[constant];
+            if (constantMap[index] == -1) {
+                constantMap[index] = addConstant(vm, &result, chunk->constants.values[index]);
+            }
+            operands[constant] = constantMap[index];
+        }
+
+        int line = instruction->line;
+        switch (instruction->opcode) {
+            // superinstructions only have one-byte operands, so they are split
+            // up again when an operand doesn't fit
+            case OP_CONSTANT_DEFINE_GLOBAL:
+                if (operands[0] > UINT8_MAX || operands[1] > UINT8_MAX) {
+                    encodeInstruction(vm, &result, OP_CONSTANT, operands[0], line);
+                    encodeInstruction(vm, &result, OP_DEFINE_GLOBAL, operands[1], line);
+                    continue;
+                }
+                break;
+            case OP_GET_GLOBAL_CONSTANT_ADD:
+                if (operands[0] > UINT8_MAX || operands[1] > UINT8_MAX) {
+                    encodeInstruction(vm, &result, OP_GET_GLOBAL, operands[0], line);
+                    encodeInstruction(vm, &result, OP_CONSTANT, operands[1], line);
+                    encodeInstruction(vm, &result, OP_ADD, 0, line);
+                    continue;
+                }
+                break;
+            case OP_SET_GLOBAL_POP:
+                if (operands[0] > UINT8_MAX) {
+                    encodeInstruction(vm, &result, OP_SET_GLOBAL, operands[0], line);
+                    encodeInstruction(vm, &result, OP_POP, 0, line);
+                    continue;
+                }
+                break;
+            default:
+                encodeInstruction(vm, &result, instruction->opcode, operands[0], line);
+                continue;
+        }
+
+        writeChunk(vm, &result, instruction->opcode, line);
+        for (int j = 1; j < instructionSize(instruction->opcode); j++) {
+            writeChunk(vm, &result, (uint8_t)operands[j - 1], line);
+        }
+    }
+
+    FREE_ARRAY(vm, int, constantMap, chunk->constants.count);
+    // the statistics describe what the compiler asked for, not the copying above
+    result.constantRequests = chunk->constantRequests;
+    freeChunk(vm, chunk);
+    *chunk = result;
+}
+
+// Writes an instruction with at most one operand, in its wide form if it has
+// one and the operand needs it.
+static void encodeInstruction(VM* vm, Chunk* chunk, uint8_t opcode, int operand, int line) {
+    int longForm = longOpcode(opcode);
+    if (longForm != -1) {
+        writeOperand(vm, chunk, opcode, (uint8_t)longForm, operand, line);
+        return;
+    }
+
+    writeChunk(vm, chunk, opcode, line);
+    if (instructionSize(opcode) == 2) {
+        writeChunk(vm, chunk, (uint8_t)operand, line);
+    }
+}
+
+static void optimize(VM* vm, Chunk* chunk, InstructionArray* in, InstructionArray* out) {
+    for (int i = 0; i < in->count; i++) {
+        Instruction* instruction = &in->instructions[i];
+
+        switch (instruction->opcode) {
+            case OP_NEGATE:
+            case OP_NOT:
+                if (foldUnary(vm, chunk, out, instruction)) {
+                    continue;
+                }
+                break;
+            case OP_ADD:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_MULTIPLY:
+            case OP_NOT_EQUAL:
+            case OP_SUBTRACT:
+                if (foldBinary(vm, chunk, out, instruction)) {
+                    continue;
+                }
+                break;
+            case OP_CONCAT_N:
+                if (foldConcat(vm, chunk, out, instruction)) {
+                    continue;
+                }
+                break;
+            case OP_POP:
+            case OP_POPN:
+                if (removeDeadPush(vm, out, instruction)) {
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+
+        if (fuse(out, instruction)) {
+            continue;
+        }
+
+        writeInstruction(vm, out, instruction->opcode, instruction->operands[0], instruction->line);
+    }
+}
+
+static bool foldUnary(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction) {
+    Instruction* operand = last(out, 0);
+
+    if (instruction->opcode == OP_NOT) {
+        // !(a == b) is a != b and vice versa
+        if (operand != NULL && operand->opcode == OP_EQUAL) {
+            operand->opcode = OP_NOT_EQUAL;
+            return true;
+        }
+        if (operand != NULL && operand->opcode == OP_NOT_EQUAL) {
+            operand->opcode = OP_EQUAL;
+            return true;
+        }
+    }
+
+    if (operand == NULL || !isConstant(operand)) {
+        return false;
+    }
+
+    Value value = constantValue(chunk, operand);
+    Value result;
+    if (instruction->opcode == OP_NOT) {
+        result = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+    } else if (IS_NUMBER(value)) {
+        result = NUMBER_VAL(-AS_NUMBER(value));
+    } else {
+        // negating anything else is a runtime error, which must still happen at runtime
+        return false;
+    }
+
+    out->count--;
+    emitValue(vm, chunk, out, result, instruction->line);
+    return true;
+}
+
+static bool foldBinary(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction) {
+    Instruction* left = last(out, 1);
+    Instruction* right = last(out, 0);
+    if (left == NULL || !isConstant(left) || !isConstant(right)) {
+        return false;
+    }
+
+    Value a = constantValue(chunk, left);
+    Value b = constantValue(chunk, right);
+    Value result;
+
+    if (instruction->opcode == OP_EQUAL || instruction->opcode == OP_NOT_EQUAL) {
+        // constant strings are interned, so comparing them here is exact
+        bool equal = valuesEqual(a, b);
+        result = BOOL_VAL(instruction->opcode == OP_EQUAL ? equal : !equal);
+    } else {
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+            // string concatenation and type errors are left to the VM
+            return false;
+        }
+
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (instruction->opcode) {
+            case OP_ADD: result = NUMBER_VAL(x + y); break;
+            case OP_DIVIDE: result = NUMBER_VAL(x / y); break;
+            case OP_GREATER: result = BOOL_VAL(x > y); break;
+            case OP_GREATER_EQUAL: result = BOOL_VAL(x >= y); break;
+            case OP_LESS: result = BOOL_VAL(x < y); break;
+            case OP_LESS_EQUAL: result = BOOL_VAL(x <= y); break;
+            case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+            case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+            default:
+                // unreachable
+                return false;
+        }
+    }
+
+    out->count -= 2;
+    emitValue(vm, chunk, out, result, instruction->line);
+    return true;
+}
+
+// Folds a chain of + whose operands are all number constants.
+static bool foldConcat(VM* vm, Chunk* chunk, InstructionArray* out, Instruction* instruction) {
+    int count = instruction->operands[0];
+    if (out->count < count) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Instruction* operand = last(out, i);
+        if (!isConstant(operand) || !IS_NUMBER(constantValue(chunk, operand))) {
+            // string concatenation and type errors are left to the VM
+            return false;
+        }
+    }
+
+    // summed left to right, like the VM does
+    double sum = AS_NUMBER(constantValue(chunk, last(out, count - 1)));
+    for (int i = count - 2; i >= 0; i--) {
+        sum += AS_NUMBER(constantValue(chunk, last(out, i)));
+    }
+
+    out->count -= count;
+    emitValue(vm, chunk, out, NUMBER_VAL(sum), instruction->line);
+    return true;
+}
+
+// A value that is pushed and immediately popped again has no effect.
+static bool removeDeadPush(VM* vm, InstructionArray* out, Instruction* instruction) {
+    int popCount = instruction->opcode == OP_POPN ? instruction->operands[0] : 1;
+    int removed = 0;
+    while (removed < popCount) {
+        Instruction* previous = last(out, 0);
+        if (previous == NULL || !isPurePush(previous)) {
+            break;
+        }
+        out->count--;
+        removed++;
+    }
+
+    if (removed == 0) {
+        return false;
+    }
+
+    popCount -= removed;
+    if (popCount == 1) {
+        writeInstruction(vm, out, OP_POP, 0, instruction->line);
+    } else if (popCount > 1) {
+        writeInstruction(vm, out, OP_POPN, popCount, instruction->line);
+    }
+    return true;
+}
+
+// Merges the instruction into a superinstruction with the ones emitted before
+// it. Only instructions from the same line are fused, so runtime errors still
+// report the right line.
+static bool fuse(InstructionArray* out, Instruction* instruction) {
+    Instruction* previous = last(out, 0);
+    if (previous == NULL || previous->line != instruction->line) {
+        return false;
+    }
+
+    switch (instruction->opcode) {
+        case OP_POP:
+            if (previous->opcode == OP_SET_GLOBAL) {
+                previous->opcode = OP_SET_GLOBAL_POP;
+                return true;
+            }
+            if (previous->opcode == OP_SET_LOCAL) {
+                previous->opcode = OP_SET_LOCAL_POP;
+                return true;
+            }
+            return false;
+        case OP_DEFINE_GLOBAL:
+            if (previous->opcode == OP_CONSTANT) {
+                previous->opcode = OP_CONSTANT_DEFINE_GLOBAL;
+                previous->operands[1] = instruction->operands[0];
+                return true;
+            }
+            return false;
+        case OP_ADD: {
+            Instruction* global = last(out, 1);
+            if (previous->opcode == OP_CONSTANT && global != NULL
+                    && global->opcode == OP_GET_GLOBAL && global->line == instruction->line) {
+                global->opcode = OP_GET_GLOBAL_CONSTANT_ADD;
+                global->operands[1] = previous->operands[0];
+                out->count--;
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+// Returns which operand of the instruction is a constant index, or -1 if none is.
+static int constantOperand(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_DEFINE_GLOBAL:
+            return 0;
+        case OP_GET_GLOBAL_CONSTANT_ADD:
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+// Returns the wide form of an instruction, or -1 if it doesn't have one.
+static int longOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT: return OP_CONSTANT_LONG;
+        case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+        case OP_GET_GLOBAL: return OP_GET_GLOBAL_LONG;
+        case OP_SET_GLOBAL: return OP_SET_GLOBAL_LONG;
+        default: return -1;
+    }
+}
+
+// Returns the one-byte form of a wide instruction, or -1 if it isn't one.
+static int shortOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT_LONG: return OP_CONSTANT;
+        case OP_DEFINE_GLOBAL_LONG: return OP_DEFINE_GLOBAL;
+        case OP_GET_GLOBAL_LONG: return OP_GET_GLOBAL;
+        case OP_SET_GLOBAL_LONG: return OP_SET_GLOBAL;
+        default: return -1;
+    }
+}
+
+static bool isConstant(Instruction* instruction) {
+    switch (instruction->opcode) {
+        case OP_CONSTANT:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns true if the instruction only pushes a value and can never fail.
+static bool isPurePush(Instruction* instruction) {
+    return isConstant(instruction) || instruction->opcode == OP_GET_LOCAL;
+}
+
+static Value constantValue(Chunk* chunk, Instruction* instruction) {
+    switch (instruction->opcode) {
+        case OP_TRUE:
+            return BOOL_VAL(true);
+        case OP_FALSE:
+            return BOOL_VAL(false);
+        case OP_NIL:
+            return NIL_VAL;
+        default:
+            return chunk->constants.values[instruction->operands[0]];
+    }
+}
+
+static void emitValue(VM* vm, Chunk* chunk, InstructionArray* out, Value value, int line) {
+    if (IS_BOOL(value)) {
+        writeInstruction(vm, out, AS_BOOL(value) ? OP_TRUE : OP_FALSE, 0, line);
+    } else if (IS_NIL(value)) {
+        writeInstruction(vm, out, OP_NIL, 0, line);
+    } else {
+        writeInstruction(vm, out, OP_CONSTANT, addConstant(vm, chunk, value), line);
+    }
+}
+
+// Returns the instruction emitted `distance` instructions ago, if there is one.
+static Instruction* last(InstructionArray* out, int distance) {
+    if (out->count <= distance) {
+        return NULL;
+    }
+    return &out->instructions[out->count - 1 - distance];
+}
@@ -0,0 +1,8 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void optimizeChunk(VM* vm, Chunk* chunk);
+
+#endif
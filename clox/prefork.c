@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "prefork.h"
+#include "script.h"
+
+// what a worker sends back before it exits, followed by its output and errors
+typedef struct {
+    int32_t status;
+    double seconds;
+    ProcessMemory memory;
+    uint64_t outputLength;
+    uint64_t errorsLength;
+} WorkerResult;
+
+typedef struct {
+    pid_t pid;
+    int channel; // the read end of the pipe the worker sends its result on
+} Worker;
+
+static void startWorker(VM* vm, Worker* worker, const char* path);
+static void runWorker(VM* vm, const char* path, int channel);
+static int finishWorker(Worker* worker, const char* path, int index, int count, ProcessMemory* memory);
+
+int runPrefork(VM* vm, const char* prelude, const char** paths, int count, int workers) {
+    if (workers > count) {
+        workers = count;
+    }
+
+    double start = now();
+    int status = runScript(vm, prelude);
+    if (status != 0) {
+        return status;
+    }
+    freezeHeap(vm);
+    ProcessMemory warm = processMemory();
+    fprintf(stderr, "%s: %.3f s, %ld KB resident\n", prelude, now() - start, warm.resident);
+
+    // anything still buffered would be written again by every worker
+    fflush(stdout);
+    fflush(stderr);
+
+    Worker* pool = calloc(count, sizeof(Worker));
+    if (pool == NULL) {
+        exit(1);
+    }
+
+    start = now();
+    int started = 0;
+    int failed = 0;
+    long totalPrivate = 0;
+    long maxPrivate = 0;
+    long totalShared = 0;
+    for (int i = 0; i < count; i++) {
+        while (started < count && started < i + workers) {
+            startWorker(vm, &pool[started], paths[started]);
+            started++;
+        }
+
+        ProcessMemory memory;
+        int workerStatus = finishWorker(&pool[i], paths[i], i, count, &memory);
+        if (workerStatus != 0) {
+            failed++;
+            if (status == 0) {
+                status = workerStatus;
+            }
+        }
+        totalPrivate += memory.private;
+        totalShared += memory.shared;
+        if (memory.private > maxPrivate) {
+            maxPrivate = memory.private;
+        }
+    }
+
+    double elapsed = now() - start;
+    fprintf(stderr, "%d scripts, %d failed, %.3f s on %d workers, %.1f scripts/s\n",
+            count, failed, elapsed, workers, count / elapsed);
+    if (warm.resident >= 0) {
+        fprintf(stderr, "worker memory: %ld KB private on average, %ld KB at most, %ld KB shared on average\n",
+                totalPrivate / count, maxPrivate, totalShared / count);
+    }
+
+    free(pool);
+    return status;
+}
+
+// Reads the totals the kernel keeps for the whole address space.
+ProcessMemory processMemory() {
+    ProcessMemory memory = { -1, -1, -1 };
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL) {
+        return memory;
+    }
+
+    memory.resident = 0;
+    memory.private = 0;
+    memory.shared = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        long kilobytes;
+        if (sscanf(line, "Rss: %ld kB", &kilobytes) == 1) {
+            memory.resident = kilobytes;
+        } else if (sscanf(line, "Private_Clean: %ld kB", &kilobytes) == 1
+                || sscanf(line, "Private_Dirty: %ld kB", &kilobytes) == 1) {
+            memory.private += kilobytes;
+        } else if (sscanf(line, "Shared_Clean: %ld kB", &kilobytes) == 1
+                || sscanf(line, "Shared_Dirty: %ld kB", &kilobytes) == 1) {
+            memory.shared += kilobytes;
+        }
+    }
+    fclose(file);
+    return memory;
+}
+
+static void startWorker(VM* vm, Worker* worker, const char* path) {
+    int channel[2];
+    if (pipe(channel) != 0) {
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        exit(1);
+    }
+    if (pid == 0) {
+        close(channel[0]);
+        runWorker(vm, path, channel[1]);
+    }
+
+    close(channel[1]);
+    worker->pid = pid;
+    worker->channel = channel[0];
+}
+
+// Runs in the forked worker, with the parent's frozen heap. It never returns:
+// freeing the VM on the way out would only write to the shared pages.
+static void runWorker(VM* vm, const char* path, int channel) {
+    double start = now();
+    char* output;
+    size_t outputLength;
+    char* errors;
+    size_t errorsLength;
+    vm->output = openCapture(&output, &outputLength);
+    vm->errors = openCapture(&errors, &errorsLength);
+
+    int status = runScript(vm, path);
+
+    fclose(vm->output);
+    fclose(vm->errors);
+    WorkerResult result;
+    memset(&result, 0, sizeof(result));
+    result.status = status;
+    result.seconds = now() - start;
+    result.memory = processMemory();
+    result.outputLength = outputLength;
+    result.errorsLength = errorsLength;
+
+    writeAll(channel, &result, sizeof(result));
+    writeAll(channel, output, outputLength);
+    writeAll(channel, errors, errorsLength);
+    fflush(stdout); // the debug builds trace to it
+    _exit(status);
+}
+
+// Waits for the worker's result and writes it out: what the script printed,
+// then its errors and how it went.
+static int finishWorker(Worker* worker, const char* path, int index, int count, ProcessMemory* memory) {
+    WorkerResult result;
+    char* output = NULL;
+    char* errors = NULL;
+    bool received = readAll(worker->channel, &result, sizeof(result));
+    if (received) {
+        output = malloc(result.outputLength + 1);
+        errors = malloc(result.errorsLength + 1);
+        if (output == NULL || errors == NULL) {
+            exit(1);
+        }
+        received = readAll(worker->channel, output, result.outputLength)
+            && readAll(worker->channel, errors, result.errorsLength);
+    }
+    close(worker->channel);
+
+    int status;
+    while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (!received) {
+        // the worker died before it could report, e.g. killed by a signal
+        fprintf(stderr, "[%d/%d] %s: worker died\n", index + 1, count, path);
+        free(output);
+        free(errors);
+        *memory = (ProcessMemory){ 0, 0, 0 };
+        return EXIT_RUNTIME_ERROR;
+    }
+
+    fwrite(output, 1, result.outputLength, stdout);
+    fflush(stdout);
+    fwrite(errors, 1, result.errorsLength, stderr);
+    fprintf(stderr, "[%d/%d] %s: ", index + 1, count, path);
+    if (result.status == 0) {
+        fprintf(stderr, "ok");
+    } else {
+        fprintf(stderr, "exit %d", result.status);
+    }
+    fprintf(stderr, ", %.3f s, %ld KB private, %ld KB shared\n",
+            result.seconds, result.memory.private, result.memory.shared);
+
+    free(output);
+    free(errors);
+    *memory = result.memory;
+    return result.status;
+}
@@ -0,0 +1,24 @@
+#ifndef clox_prefork_h
+#define clox_prefork_h
+
+#include "common.h"
+#include "vm.h"
+
+// How much of a process's memory is resident, in kilobytes, split into the
+// pages only it uses and the ones it shares with other processes. All -1 where
+// /proc/self/smaps_rollup can't be read.
+typedef struct {
+    long resident;
+    long private;
+    long shared;
+} ProcessMemory;
+
+// Runs the prelude in the VM, freezes the heap it leaves behind, and then runs
+// each script in a process forked from this one, at most workers at a time.
+// The forked workers share the prelude's globals and strings copy-on-write.
+// Output and the status line of each script are written in order, like
+// runJobs() does, with the private memory of its worker.
+int runPrefork(VM* vm, const char* prelude, const char** paths, int count, int workers);
+ProcessMemory processMemory();
+
+#endif
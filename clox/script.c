@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "script.h"
+
+static int runBytecode(VM* vm, Bytecode* bytecode, const char* path);
+static int runSource(VM* vm, char* source);
+
+// Returns the contents of the file in a buffer the caller frees, or NULL once
+// the problem has been reported to errors.
+char* readFile(const char* path, FILE* errors) {
+    // open the file
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(errors, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    // seek the file to find the size, then rewind
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    // allocate the buffer and read the file
+    char* buffer = (char*) malloc(fileSize + 1);
+    if (buffer == NULL) {
+        fprintf(errors, "Not enouogh memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
+    }
+    size_t byteRead = fread(buffer, sizeof(char), fileSize, file);
+    if (byteRead < fileSize) {
+        fprintf(errors, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[byteRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+// Runs a source file, or a bytecode file written by --compile, and returns
+// the status the clox command exits with.
+int runScript(VM* vm, const char* path) {
+    if (isBytecodeFile(path)) {
+        Bytecode bytecode;
+        if (!mapBytecode(path, &bytecode, vm->errors)) {
+            return EXIT_IO_ERROR;
+        }
+        return runBytecode(vm, &bytecode, path);
+    }
+
+    char* source = readFile(path, vm->errors);
+    if (source == NULL) {
+        return EXIT_IO_ERROR;
+    }
+    return runSource(vm, source);
+}
+
+// Runs a script handed over in memory, such as one sent to --serve: either
+// source, which must be NUL-terminated, or the contents of a bytecode file.
+// name stands in for the path in error messages.
+int runBuffer(VM* vm, const char* data, size_t size, const char* name) {
+    if (isBytecode((const uint8_t*)data, size)) {
+        Bytecode bytecode;
+        if (!copyBytecode((const uint8_t*)data, size, name, &bytecode, vm->errors)) {
+            return EXIT_IO_ERROR;
+        }
+        return runBytecode(vm, &bytecode, name);
+    }
+
+    return exitStatus(interpret(vm, data));
+}
+
+int exitStatus(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_COMPILE_ERROR: return EXIT_COMPILE_ERROR;
+        case INTERPRET_RUNTIME_ERROR: return EXIT_RUNTIME_ERROR;
+        default: return 0;
+    }
+}
+
+// Opens a stream that writes to a buffer the caller frees once it is closed.
+FILE* openCapture(char** buffer, size_t* length) {
+    FILE* file = open_memstream(buffer, length);
+    if (file == NULL) {
+        exit(1);
+    }
+    return file;
+}
+
+bool writeAll(int fd, const void* data, size_t length) {
+    const char* next = data;
+    while (length > 0) {
+        // send() is what can leave out the SIGPIPE, but it only takes sockets
+        ssize_t written = send(fd, next, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == ENOTSOCK) {
+            written = write(fd, next, length);
+        }
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        next += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool readAll(int fd, void* data, size_t length) {
+    char* next = data;
+    while (length > 0) {
+        ssize_t received = read(fd, next, length);
+        if (received == 0) {
+            return false;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        next += received;
+        length -= received;
+    }
+    return true;
+}
+
+// Seconds on the monotonic clock.
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs and frees the bytecode. If its source is still around, the source is
+// run instead when it has changed since, or when the bytecode can't be loaded
+// into this VM, e.g. because a heap image gave its globals other slots. The
+// source path of untrusted bytecode names a file of the client's, not ours, so
+// it is never read.
+static int runBytecode(VM* vm, Bytecode* bytecode, const char* path) {
+    char* source = NULL;
+    if (!bytecode->untrusted && access(bytecode->sourcePath, R_OK) == 0) {
+        source = readFile(bytecode->sourcePath, vm->errors);
+        if (source == NULL) {
+            freeBytecode(vm, bytecode);
+            return EXIT_IO_ERROR;
+        }
+        if (hashSource(source) != bytecode->sourceHash) {
+            fprintf(vm->errors, "\"%s\" is out of date, running \"%s\" instead.\n", path, bytecode->sourcePath);
+            freeBytecode(vm, bytecode);
+            return runSource(vm, source);
+        }
+    }
+
+    if (!loadBytecode(vm, bytecode)) {
+        if (source == NULL) {
+            freeBytecode(vm, bytecode);
+            return EXIT_IO_ERROR;
+        }
+        fprintf(vm->errors, "Running \"%s\" instead.\n", bytecode->sourcePath);
+        freeBytecode(vm, bytecode);
+        return runSource(vm, source);
+    }
+    free(source);
+
+    InterpretResult result = interpretChunk(vm, &bytecode->chunk);
+    freeBytecode(vm, bytecode);
+    return exitStatus(result);
+}
+
+// Runs and frees a source buffer from readFile().
+static int runSource(VM* vm, char* source) {
+    InterpretResult result = interpret(vm, source);
+    free(source);
+    return exitStatus(result);
+}
@@ -0,0 +1,27 @@
+#ifndef clox_script_h
+#define clox_script_h
+
+#include "vm.h"
+
+// The exit statuses of the clox command, after sysexits.h.
+#define EXIT_COMPILE_ERROR 65
+#define EXIT_RUNTIME_ERROR 70
+#define EXIT_IO_ERROR 74
+
+// Running a file the way the clox command does, except that nothing exits:
+// errors go to the VM's error stream and the status is returned.
+char* readFile(const char* path, FILE* errors);
+int runScript(VM* vm, const char* path);
+int runBuffer(VM* vm, const char* data, size_t size, const char* name);
+int exitStatus(InterpretResult result);
+
+// What the ways of running many scripts at once (--jobs, --prefork and
+// --serve) share. openCapture() exits when it can't open the stream;
+// writeAll() and readAll() return false on an error or a hang-up, and a
+// hang-up on a socket is never a SIGPIPE.
+FILE* openCapture(char** buffer, size_t* length);
+bool writeAll(int fd, const void* data, size_t length);
+bool readAll(int fd, void* data, size_t length);
+double now();
+
+#endif
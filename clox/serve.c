@@ -0,0 +1,332 @@
+#define _GNU_SOURCE // for fopencookie()
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "script.h"
+#include "serve.h"
+#include "vm.h"
+
+typedef struct {
+    int listener;
+    int optimizationLevel;
+    atomic_long requests;
+} Server;
+
+// what a script's output or errors stream writes frames of, to its connection
+typedef struct {
+    int connection;
+    FrameType type;
+} Stream;
+
+static bool openSocket(const char* path, struct sockaddr_un* address, FILE* errors);
+static void* work(void* argument);
+static void handleRequest(Server* server, VM* vm, int connection);
+static char* receiveScript(int connection, size_t* length, FILE* errors);
+static FILE* openStream(Stream* stream);
+static ssize_t writeStream(void* cookie, const char* buffer, size_t size);
+static bool sendFrame(int connection, FrameType type, const void* data, size_t length);
+static long long milliseconds();
+
+int serve(const char* path, int workers, int optimizationLevel) {
+    struct sockaddr_un address;
+    if (!openSocket(path, &address, stderr)) {
+        return EXIT_IO_ERROR;
+    }
+
+    // a socket file left behind by an earlier server is replaced, anything
+    // else at the path is not. One a server still listens on is left to it:
+    // taking the path over would orphan that server, and its unlink() on the
+    // way out would take the path from this one
+    struct stat status;
+    if (lstat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0) {
+            close(probe);
+            fprintf(stderr, "A server is already serving on \"%s\".\n", path);
+            return EXIT_IO_ERROR;
+        }
+        if (probe >= 0 && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        if (probe >= 0) {
+            close(probe);
+        }
+    }
+
+    Server server;
+    server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    server.optimizationLevel = optimizationLevel;
+    atomic_init(&server.requests, 0);
+    if (server.listener < 0
+            || bind(server.listener, (struct sockaddr*)&address, sizeof(address)) != 0
+            || listen(server.listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", path, strerror(errno));
+        if (server.listener >= 0) {
+            close(server.listener);
+        }
+        return EXIT_IO_ERROR;
+    }
+
+    // the workers inherit the blocked signals, so only sigwait() below sees
+    // them; a client that hangs up early mustn't kill the server either
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+    if (threads == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, work, &server);
+    }
+    fprintf(stderr, "Serving on \"%s\" with %d workers.\n", path, workers);
+
+    int caught;
+    sigwait(&signals, &caught);
+
+    // wakes the workers up from accept(); each finishes the script it is running
+    shutdown(server.listener, SHUT_RDWR);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(server.listener);
+    unlink(path);
+    fprintf(stderr, "Served %ld scripts.\n", atomic_load(&server.requests));
+
+    free(threads);
+    return 0;
+}
+
+int sendScript(const char* path, FILE* script, FILE* output, FILE* errors) {
+    struct sockaddr_un address;
+    if (!openSocket(path, &address, errors)) {
+        return EXIT_IO_ERROR;
+    }
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(errors, "Could not connect to \"%s\": %s.\n", path, strerror(errno));
+        if (connection >= 0) {
+            close(connection);
+        }
+        return EXIT_IO_ERROR;
+    }
+
+    char buffer[64 * 1024];
+    size_t count;
+    bool sent = true;
+    while (sent && (count = fread(buffer, 1, sizeof(buffer), script)) > 0) {
+        sent = writeAll(connection, buffer, count);
+    }
+    shutdown(connection, SHUT_WR);
+
+    // the output and the errors are passed on as they arrive, until the status;
+    // a server that stopped reading the script early still says why
+    int status = -1;
+    FrameHeader header;
+    while (status < 0 && readAll(connection, &header, sizeof(header))) {
+        char* data = header.length <= sizeof(buffer) ? buffer : malloc(header.length);
+        if (data == NULL) {
+            exit(1);
+        }
+        if (!readAll(connection, data, header.length)) {
+            if (data != buffer) {
+                free(data);
+            }
+            break;
+        }
+
+        if (header.type == FRAME_OUTPUT) {
+            fwrite(data, 1, header.length, output);
+        } else if (header.type == FRAME_ERRORS) {
+            fwrite(data, 1, header.length, errors);
+        } else if (header.type == FRAME_STATUS && header.length == sizeof(int32_t)) {
+            int32_t result;
+            memcpy(&result, data, sizeof(result));
+            status = result;
+        }
+        if (data != buffer) {
+            free(data);
+        }
+    }
+    close(connection);
+
+    if (status < 0) {
+        fprintf(errors, "\"%s\" hung up before the script finished.\n", path);
+        return EXIT_IO_ERROR;
+    }
+    return status;
+}
+
+static bool openSocket(const char* path, struct sockaddr_un* address, FILE* errors) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(errors, "Socket path \"%s\" is too long.\n", path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// Each worker keeps one VM for as long as the server runs, and resets it after
+// every script, once the client has its answer. The VM keeps the strings it
+// compiles to itself, since the shared pool would keep every name and literal
+// of every request for as long as the server runs.
+static void* work(void* argument) {
+    Server* server = argument;
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) {
+        exit(1);
+    }
+    initVM(vm);
+    vm->optimizationLevel = server->optimizationLevel;
+    vm->shareStrings = false;
+
+    for (;;) {
+        int connection = accept(server->listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // the listener was shut down
+        }
+
+        handleRequest(server, vm, connection);
+        close(connection);
+        resetVM(vm);
+    }
+
+    freeVM(vm);
+    free(vm);
+    return NULL;
+}
+
+static void handleRequest(Server* server, VM* vm, int connection) {
+    Stream output = { connection, FRAME_OUTPUT };
+    Stream errors = { connection, FRAME_ERRORS };
+    vm->output = openStream(&output);
+    vm->errors = openStream(&errors);
+
+    // a client that stops reading can't hold the worker for longer either
+    struct timeval timeout = { SERVE_TIMEOUT_MS / 1000, (SERVE_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    int32_t status = EXIT_IO_ERROR;
+    size_t length;
+    char* script = receiveScript(connection, &length, vm->errors);
+    if (script != NULL) {
+        status = runBuffer(vm, script, length, "<request>");
+        free(script);
+    }
+
+    fclose(vm->output);
+    fclose(vm->errors);
+    vm->output = stdout;
+    vm->errors = stderr;
+    sendFrame(connection, FRAME_STATUS, &status, sizeof(status));
+    atomic_fetch_add(&server->requests, 1);
+}
+
+// Reads until the client shuts down its side, and NUL-terminates what it sent
+// in case it is source. The whole script has to arrive within SERVE_TIMEOUT_MS
+// and fit in SERVE_MAX_SCRIPT bytes; otherwise it returns NULL once the problem
+// has been reported to errors.
+static char* receiveScript(int connection, size_t* length, FILE* errors) {
+    long long deadline = milliseconds() + SERVE_TIMEOUT_MS;
+    size_t capacity = 4096;
+    size_t count = 0;
+    char* script = malloc(capacity);
+    if (script == NULL) {
+        exit(1);
+    }
+
+    for (;;) {
+        if (count > SERVE_MAX_SCRIPT) {
+            fprintf(errors, "The script is larger than %d bytes.\n", SERVE_MAX_SCRIPT);
+            free(script);
+            return NULL;
+        }
+        if (count + 1 == capacity) {
+            // one byte past the limit is enough to tell the script is too big
+            capacity = capacity * 2 < SERVE_MAX_SCRIPT + 2 ? capacity * 2 : SERVE_MAX_SCRIPT + 2;
+            script = realloc(script, capacity);
+            if (script == NULL) {
+                exit(1);
+            }
+        }
+
+        long long remaining = deadline - milliseconds();
+        struct pollfd readable = { connection, POLLIN, 0 };
+        int ready = remaining > 0 ? poll(&readable, 1, (int)remaining) : 0;
+        if (ready == 0) {
+            fprintf(errors, "Timed out waiting for the script.\n");
+            free(script);
+            return NULL;
+        }
+
+        ssize_t received = ready < 0 ? -1 : read(connection, script + count, capacity - count - 1);
+        if (received == 0) {
+            break;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(errors, "Could not read the script.\n");
+            free(script);
+            return NULL;
+        }
+        count += received;
+    }
+
+    script[count] = '\0';
+    *length = count;
+    return script;
+}
+
+// A stdio stream that writes what is put in it to the connection as frames of
+// the stream's type, a buffer at a time.
+static FILE* openStream(Stream* stream) {
+    cookie_io_functions_t functions = { NULL, writeStream, NULL, NULL };
+    FILE* file = fopencookie(stream, "w", functions);
+    if (file == NULL) {
+        exit(1);
+    }
+    return file;
+}
+
+static ssize_t writeStream(void* cookie, const char* buffer, size_t size) {
+    Stream* stream = cookie;
+    if (!sendFrame(stream->connection, stream->type, buffer, size)) {
+        return -1;
+    }
+    return size;
+}
+
+static bool sendFrame(int connection, FrameType type, const void* data, size_t length) {
+    FrameHeader header = { type, (uint32_t)length };
+    return writeAll(connection, &header, sizeof(header)) && writeAll(connection, data, length);
+}
+
+static long long milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,38 @@
+#ifndef clox_serve_h
+#define clox_serve_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// A client sends a script over the socket, either source or the contents of a
+// bytecode file, and shuts down its side of the connection. The server answers
+// with frames: what the script prints and the errors it reports as they are
+// written, then one with the status the clox command would have exited with.
+// Every frame starts with a FrameHeader, in the byte order of the machine,
+// since both ends are on it.
+typedef enum {
+    FRAME_OUTPUT,
+    FRAME_ERRORS,
+    FRAME_STATUS, // an int32_t, 0 or one of the EXIT_* statuses of script.h
+} FrameType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t length; // of the data that follows
+} FrameHeader;
+
+// A worker serves one client at a time, so one that is slow to send its script
+// or to read the answer is cut off after this long, and a script bigger than
+// this is refused; either way the client gets EXIT_IO_ERROR if it is listening.
+#define SERVE_TIMEOUT_MS 10000
+#define SERVE_MAX_SCRIPT (16 * 1024 * 1024)
+
+// Serves scripts on a Unix socket at path until SIGINT or SIGTERM, with a VM
+// per worker thread that is reset between scripts rather than rebuilt.
+int serve(const char* path, int workers, int optimizationLevel);
+// Sends the script to the server at path, writes what comes back to output and
+// errors, and returns the script's status.
+int sendScript(const char* path, FILE* script, FILE* output, FILE* errors);
+
+#endif
@@ -6,29 +6,82 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) && !defined(TABLE_SCALAR)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
 
-static void adjustCapacity(Table* table, int capacity);
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key);
+// the table is resized before more than 7/8 of its slots are taken, or once
+// fewer than 1/8 of them hold entries; either way the new slots are at most
+// half full
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 8 * 7)
+#define TABLE_MIN_LOAD(capacity) ((capacity) / 8)
+
+// full slots have the top bit of their control byte clear
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define IS_FULL(control) ((control) < 0x80)
+#define ALL_SLOTS ((1u << TABLE_GROUP_SIZE) - 1)
+
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+
+// the high bits of a hash pick the first group to probe, the low 7 bits are the
+// tag kept in the control byte
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
+
+static void initSlots(TableSlots* slots);
+static void allocateSlots(VM* vm, TableSlots* slots, int capacity);
+static void freeSlots(VM* vm, TableSlots* slots);
+static Entry* findEntry(Table* table, ObjString* key);
+static int findSlot(TableSlots* slots, ObjString* key);
+static ObjString* findString(TableSlots* slots, const char* chars, int length, uint32_t hash);
+static void insertSlot(TableSlots* slots, ObjString* key, Value value);
+static void deleteSlot(TableSlots* slots, int slot);
+static int removeWhite(TableSlots* slots);
+static void markSlots(VM* vm, TableSlots* slots);
+static uint64_t probeLength(TableSlots* slots);
+static void startResize(VM* vm, Table* table, int capacity);
+static void migrate(VM* vm, Table* table, int groups);
+static int fitCapacity(int count);
+static uint32_t matchTag(const uint8_t* group, uint8_t tag);
+static uint32_t matchEmpty(const uint8_t* group);
+static uint32_t matchFree(const uint8_t* group);
+static int lowestSlot(uint32_t matches);
 
 void initTable(Table* table) {
-    table->capacity = 0;
     table->count = 0;
-    table->entries = NULL;
+    initSlots(&table->slots);
+    initSlots(&table->old);
+    table->migrated = 0;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    freeSlots(vm, &table->slots);
+    freeSlots(vm, &table->old);
     initTable(table);
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
-    if (table->count == 0) {
-        return false;
+// Empties the table but keeps its slots, for a VM that is reset between
+// scripts. A resize in progress is dropped along with the old slots.
+void clearTable(VM* vm, Table* table) {
+    freeSlots(vm, &table->old);
+    table->count = 0;
+    table->migrated = 0;
+    table->slots.count = 0;
+    table->slots.tombstones = 0;
+    if (table->slots.capacity > 0) {
+        memset(table->slots.control, CONTROL_EMPTY, table->slots.capacity);
     }
+}
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+bool tableGet(Table* table, ObjString* key, Value* value) {
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) {
         return false;
     }
 
@@ -36,123 +89,398 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+    Entry* entry = findEntry(table, key);
+    if (entry != NULL) {
+        entry->value = value;
+        return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = (entry->key == NULL);
-    if (isNewKey && IS_NIL(entry->value)) {
-        // increment the count only if the new entry goes into an entirely empty bucket (i.e. not a tombstone)
-        table->count++;
+    // the old slots count against the new ones, which they will end up in.
+    // Shrinking waits for an insert, since tableDelete() runs in the middle of
+    // collections and mustn't allocate.
+    TableSlots* slots = &table->slots;
+    bool full = slots->count + slots->tombstones + table->old.count + 1 > TABLE_MAX_LOAD(slots->capacity);
+    bool sparse = table->old.capacity == 0 && slots->capacity > TABLE_GROUP_SIZE
+        && table->count < TABLE_MIN_LOAD(slots->capacity);
+    if (full || sparse) {
+        // a resize that hasn't finished yet is completed in one go first; the
+        // new slots have room for twice the entries, so that only happens
+        // after a big shrink
+        migrate(vm, table, table->old.capacity / TABLE_GROUP_SIZE);
+        startResize(vm, table, fitCapacity(table->count + 1));
     }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    insertSlot(&table->slots, key, value);
+    table->count++;
+    migrate(vm, table, TABLE_MIGRATE_GROUPS);
+    return true;
 }
 
-bool tableDelete(Table* table, ObjString* key)  {
-    if (table->count == 0) {
-        return false;
-    }
-
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
-        return false;
+bool tableDelete(VM* vm, Table* table, ObjString* key)  {
+    TableSlots* slots = &table->slots;
+    int slot = findSlot(slots, key);
+    if (slot < 0) {
+        slots = &table->old;
+        slot = findSlot(slots, key);
+        if (slot < 0) {
+            return false;
+        }
     }
 
-    // place a tombstone in the entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(slots, slot);
+    table->count--;
+    migrate(vm, table, TABLE_MIGRATE_GROUPS);
     return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
-    for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+void tableAddAll(VM* vm, Table* from, Table* to) {
+    TableSlots* both[] = {&from->slots, &from->old};
+    for (int i = 0; i < 2; i++) {
+        for (int slot = 0; slot < both[i]->capacity; slot++) {
+            if (IS_FULL(both[i]->control[slot])) {
+                tableSet(vm, to, both[i]->entries[slot].key, both[i]->entries[slot].value);
+            }
         }
     }
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
+    ObjString* string = findString(&table->slots, chars, length, hash);
+    if (string == NULL) {
+        string = findString(&table->old, chars, length, hash);
+    }
+    return string;
+}
+
+// Deletes the entries whose keys the collector didn't reach, so a weak table
+// doesn't point at freed strings.
+void tableRemoveWhite(Table* table) {
+    table->count -= removeWhite(&table->slots);
+    table->count -= removeWhite(&table->old);
+}
+
+// Moves the entry for key over to newKey, which must have the same hash, so it
+// stays in the same slot. The minor collector uses it for promoted strings.
+void tableRekey(Table* table, ObjString* key, ObjString* newKey) {
+    Entry* entry = findEntry(table, key);
+    if (entry != NULL) {
+        entry->key = newKey;
+    }
+}
+
+void markTable(VM* vm, Table* table) {
+    markSlots(vm, &table->slots);
+    markSlots(vm, &table->old);
+}
+
+// Returns how many groups a lookup of a key in the table looks at, on average.
+// The benchmarks use it.
+double tableProbeLength(Table* table) {
     if (table->count == 0) {
+        return 0;
+    }
+    return (double)(probeLength(&table->slots) + probeLength(&table->old)) / table->count;
+}
+
+static void initSlots(TableSlots* slots) {
+    slots->capacity = 0;
+    slots->count = 0;
+    slots->tombstones = 0;
+    slots->control = NULL;
+    slots->entries = NULL;
+}
+
+// Can start a collection.
+static void allocateSlots(VM* vm, TableSlots* slots, int capacity) {
+    initSlots(slots);
+    slots->control = ALLOCATE(vm, uint8_t, capacity);
+    slots->entries = ALLOCATE(vm, Entry, capacity);
+    slots->capacity = capacity;
+    memset(slots->control, CONTROL_EMPTY, capacity);
+}
+
+static void freeSlots(VM* vm, TableSlots* slots) {
+    FREE_ARRAY(vm, uint8_t, slots->control, slots->capacity);
+    FREE_ARRAY(vm, Entry, slots->entries, slots->capacity);
+    initSlots(slots);
+}
+
+static Entry* findEntry(Table* table, ObjString* key) {
+    int slot = findSlot(&table->slots, key);
+    if (slot >= 0) {
+        return &table->slots.entries[slot];
+    }
+    slot = findSlot(&table->old, key);
+    if (slot >= 0) {
+        return &table->old.entries[slot];
+    }
+    return NULL;
+}
+
+// Returns the slot holding key, or -1 if it isn't there.
+static int findSlot(TableSlots* slots, ObjString* key) {
+    if (slots->count == 0) {
+        return -1;
+    }
+
+    uint32_t groupMask = slots->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(key->hash) & groupMask;
+    uint8_t tag = HASH_TAG(key->hash);
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* control = &slots->control[group * TABLE_GROUP_SIZE];
+        for (uint32_t matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            int slot = group * TABLE_GROUP_SIZE + lowestSlot(matches);
+            if (slots->entries[slot].key == key) {
+                return slot;
+            }
+        }
+        // a group with an empty slot ends every probe sequence that reaches it
+        if (matchEmpty(control) != 0) {
+            return -1;
+        }
+        // triangular steps visit every group of a power-of-two table
+        group = (group + step) & groupMask;
+    }
+}
+
+static ObjString* findString(TableSlots* slots, const char* chars, int length, uint32_t hash) {
+    if (slots->count == 0) {
         return NULL;
     }
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value)) {
-                return NULL;
+    uint32_t groupMask = slots->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+    uint8_t tag = HASH_TAG(hash);
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* control = &slots->control[group * TABLE_GROUP_SIZE];
+        for (uint32_t matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            ObjString* key = slots->entries[group * TABLE_GROUP_SIZE + lowestSlot(matches)].key;
+            if (key->hash == hash && key->length == length
+                    && memcmp(key->chars, chars, length) == 0) {
+                return key;
             }
-        } else if (entry->key->length == length
-                && entry->key->hash == hash
-                && memcmp(entry->key->chars, chars, length) == 0) {
-            // found the string
-            return entry->key;
         }
+        if (matchEmpty(control) != 0) {
+            return NULL;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+// Puts a key that isn't there into the first empty or deleted slot of its probe
+// sequence. There must be room for it.
+static void insertSlot(TableSlots* slots, ObjString* key, Value value) {
+    uint32_t groupMask = slots->capacity / TABLE_GROUP_SIZE - 1;
+    uint32_t group = HASH_GROUP(key->hash) & groupMask;
+    uint32_t matches;
+    for (uint32_t step = 1; (matches = matchFree(&slots->control[group * TABLE_GROUP_SIZE])) == 0; step++) {
+        group = (group + step) & groupMask;
+    }
 
-        index  = (index + 1) % table->capacity;
+    int slot = group * TABLE_GROUP_SIZE + lowestSlot(matches);
+    if (slots->control[slot] == CONTROL_DELETED) {
+        slots->tombstones--;
     }
+    slots->control[slot] = HASH_TAG(key->hash);
+    slots->entries[slot].key = key;
+    slots->entries[slot].value = value;
+    slots->count++;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* newEntries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        newEntries[i].key = NULL;
-        newEntries[i].value = NIL_VAL;
+static void deleteSlot(TableSlots* slots, int slot) {
+    // lookups never probe past a group with an empty slot, so a slot in such a
+    // group can be emptied; elsewhere it has to stay a tombstone
+    const uint8_t* group = &slots->control[slot & ~(TABLE_GROUP_SIZE - 1)];
+    if (matchEmpty(group) != 0) {
+        slots->control[slot] = CONTROL_EMPTY;
+    } else {
+        slots->control[slot] = CONTROL_DELETED;
+        slots->tombstones++;
     }
+    slots->entries[slot].key = NULL;
+    slots->count--;
+}
 
-    // rebuild the table when resizing
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* oldEntry = &table->entries[i];
-        if (oldEntry->key == NULL) {
-            continue;
+// returns how many entries it deleted
+static int removeWhite(TableSlots* slots) {
+    int removed = 0;
+    for (int i = 0; i < slots->capacity; i++) {
+        if (IS_FULL(slots->control[i]) && !slots->entries[i].key->obj.isMarked) {
+            deleteSlot(slots, i);
+            removed++;
         }
+    }
+    return removed;
+}
+
+static void markSlots(VM* vm, TableSlots* slots) {
+    for (int i = 0; i < slots->capacity; i++) {
+        if (IS_FULL(slots->control[i])) {
+            markObject(vm, (Obj*)slots->entries[i].key);
+            markValue(vm, slots->entries[i].value);
+        }
+    }
+}
 
-        Entry* newEntry = findEntry(newEntries, capacity, oldEntry->key);
-        newEntry->key = oldEntry->key;
-        newEntry->value = oldEntry->value;
-        table->count++;
+// the number of groups the lookups of all keys look at
+static uint64_t probeLength(TableSlots* slots) {
+    uint32_t groupMask = slots->capacity / TABLE_GROUP_SIZE - 1;
+    uint64_t probes = 0;
+    for (int i = 0; i < slots->capacity; i++) {
+        if (!IS_FULL(slots->control[i])) {
+            continue;
+        }
+        uint32_t group = HASH_GROUP(slots->entries[i].key->hash) & groupMask;
+        for (uint32_t step = 1; group != (uint32_t)i / TABLE_GROUP_SIZE; step++) {
+            group = (group + step) & groupMask;
+            probes++;
+        }
+        probes++;
     }
+    return probes;
+}
 
-    // free old entries
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+// Gives the table new slots and starts moving the entries over to them. A
+// previous resize must have finished, so there are no old slots.
+static void startResize(VM* vm, Table* table, int capacity) {
+    TableSlots resized;
+    allocateSlots(vm, &resized, capacity);
 
-    table->entries = newEntries;
-    table->capacity = capacity;
+    table->old = table->slots;
+    table->slots = resized;
+    table->migrated = 0;
+    migrate(vm, table, 0);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+// Moves the entries in the next groups of old slots over to the new ones, and
+// frees the old slots once they are empty.
+static void migrate(VM* vm, Table* table, int groups) {
+    TableSlots* old = &table->old;
+    for (; groups > 0 && old->count > 0; groups--) {
+        uint32_t fullSlots = ~matchFree(&old->control[table->migrated]) & ALL_SLOTS;
+        Entry* entries = &old->entries[table->migrated];
 
-    for (;;) {
-        // linear probing
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // when we find an empty bucket, it means the key isn't present.
-                // we check if we have encountered a tombstone.
-                // if there has been a tomestone, we use the tombstone instead of the empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
-            }
-        } else if (entry->key == key) {
-            return entry;
+        // the keys and the groups they go to are all over memory, so the cache
+        // misses are started together instead of one after the other
+        for (uint32_t full = fullSlots; full != 0; full &= full - 1) {
+            PREFETCH(entries[lowestSlot(full)].key);
+        }
+        uint32_t groupMask = table->slots.capacity / TABLE_GROUP_SIZE - 1;
+        for (uint32_t full = fullSlots; full != 0; full &= full - 1) {
+            uint32_t group = HASH_GROUP(entries[lowestSlot(full)].key->hash) & groupMask;
+            PREFETCH(&table->slots.control[group * TABLE_GROUP_SIZE]);
+            PREFETCH(&table->slots.entries[group * TABLE_GROUP_SIZE]);
+        }
+
+        for (uint32_t full = fullSlots; full != 0; full &= full - 1) {
+            int slot = table->migrated + lowestSlot(full);
+            insertSlot(&table->slots, old->entries[slot].key, old->entries[slot].value);
+            // the slot stays deleted so that lookups of the old keys probe past it
+            old->control[slot] = CONTROL_DELETED;
+            old->count--;
         }
+        table->migrated += TABLE_GROUP_SIZE;
+    }
+
+    if (old->capacity != 0 && old->count == 0) {
+        freeSlots(vm, old);
+        table->migrated = 0;
+    }
+}
+
+// the smallest capacity that holds count entries with at least half the slots free
+static int fitCapacity(int count) {
+    int capacity = TABLE_GROUP_SIZE;
+    while (capacity / 2 < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// The match functions return a mask with a bit set for each slot of the group
+// whose control byte qualifies.
+#ifdef TABLE_SSE2
+
+static uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+}
+
+static uint32_t matchEmpty(const uint8_t* group) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)CONTROL_EMPTY)));
+}
+
+// empty and deleted slots are the ones with the top bit set
+static uint32_t matchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+// Without SSE2 each half of a group is handled as one 64-bit word, a byte per
+// slot, and the top bit of each byte says whether the slot matches.
+#define EACH_BYTE(byte) (0x0101010101010101ull * (byte))
+
+static uint64_t loadHalf(const uint8_t* group);
+static uint32_t packHalf(uint64_t bits);
+
+// may report a slot after a real match whose tag is one more than the one
+// asked for, which only costs a key comparison
+static uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    uint32_t matches = 0;
+    for (int half = 0; half < 2; half++) {
+        uint64_t bytes = loadHalf(group + half * 8) ^ EACH_BYTE(tag);
+        matches |= packHalf((bytes - EACH_BYTE(0x01)) & ~bytes & EACH_BYTE(0x80)) << (half * 8);
+    }
+    return matches;
+}
+
+// only empty slots have the top bit set and bit 1 clear
+static uint32_t matchEmpty(const uint8_t* group) {
+    uint32_t matches = 0;
+    for (int half = 0; half < 2; half++) {
+        uint64_t bytes = loadHalf(group + half * 8);
+        matches |= packHalf(bytes & ~(bytes << 6) & EACH_BYTE(0x80)) << (half * 8);
+    }
+    return matches;
+}
+
+static uint32_t matchFree(const uint8_t* group) {
+    uint32_t matches = 0;
+    for (int half = 0; half < 2; half++) {
+        matches |= packHalf(loadHalf(group + half * 8) & EACH_BYTE(0x80)) << (half * 8);
+    }
+    return matches;
+}
+
+// the first slot goes in the lowest byte whatever the byte order; compilers
+// turn this into a single load
+static uint64_t loadHalf(const uint8_t* group) {
+    uint64_t bytes = 0;
+    for (int i = 7; i >= 0; i--) {
+        bytes = (bytes << 8) | group[i];
+    }
+    return bytes;
+}
+
+// gathers the top bits of the eight bytes into the low eight bits
+static uint32_t packHalf(uint64_t bits) {
+    return (uint32_t)(((bits >> 7) * 0x0102040810204080ull) >> 56);
+}
+
+#endif
 
-        index = (index + 1) % capacity;
+static int lowestSlot(uint32_t matches) {
+#ifdef __GNUC__
+    return __builtin_ctz(matches);
+#else
+    int slot = 0;
+    while ((matches & 1) == 0) {
+        matches >>= 1;
+        slot++;
     }
+    return slot;
+#endif
 }
@@ -1,23 +1,52 @@
 #ifndef clox_table_h
 #define clox_table_h
 
+// The table is split into groups of TABLE_GROUP_SIZE slots. Each slot has a
+// control byte: the low 7 bits of its key's hash, or one of the markers for an
+// empty or deleted slot. A lookup compares the control bytes of a whole group
+// at once and only looks at the entries whose 7 bits match. The entries live
+// in an array of their own, so a probe only reads the control bytes.
+#define TABLE_GROUP_SIZE 16
+
+// how many groups of old slots each write moves while the table is resized
+#ifndef TABLE_MIGRATE_GROUPS
+#define TABLE_MIGRATE_GROUPS 1
+#endif
+
 typedef struct {
     ObjString* key;
     Value value;
 } Entry;
 
 typedef struct {
-    int capacity;
-    int count;
+    int capacity; // a power of two and a whole number of groups
+    int count; // full slots
+    int tombstones; // deleted slots that still make lookups probe further
+    uint8_t* control;
     Entry* entries;
+} TableSlots;
+
+// A table is resized a few groups at a time: the new slots take the inserts
+// while every write moves the next groups of the old ones over, and lookups
+// check both until the old slots are empty.
+typedef struct {
+    int count; // live entries, old and new
+    TableSlots slots;
+    TableSlots old; // the slots being moved out, with no capacity otherwise
+    int migrated; // old slots already moved
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
+void clearTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
-bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+bool tableDelete(VM* vm, Table* table, ObjString* key);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+void tableRemoveWhite(Table* table);
+void tableRekey(Table* table, ObjString* key, ObjString* newKey);
+void markTable(VM* vm, Table* table);
+double tableProbeLength(Table* table);
 
 #endif
@@ -11,23 +11,30 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        // compare as doubles so that NaN != NaN and 0 == -0
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) {
         return false;
     }
@@ -44,21 +51,37 @@ bool valuesEqual(Value a, Value b) {
             // unreachable
             return false;
     }
+#endif
 }
 
-void printValue(Value value) {
+void printValue(FILE* file, Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        fprintf(file, AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        fprintf(file, "nil");
+    } else if (IS_NUMBER(value)) {
+        fprintf(file, "%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(file, value);
+    }
+#else
     switch (value.type) {
         case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+            fprintf(file, "%g", AS_NUMBER(value));
             break;
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            fprintf(file, AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL:
-            printf("nil");
+            fprintf(file, "nil");
             break;
         case VAL_OBJ:
-            printObject(value);
+            printObject(file, value);
+            break;
+        case VAL_UNDEFINED:
+            // only marks an unset global slot, which is never printed
             break;
     }
+#endif
 }
@@ -1,15 +1,77 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
 
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+// the interpreter that owns a heap; everything that allocates takes one
+typedef struct VM VM;
+
+// UNDEFINED_VAL marks a global slot that the compiler has resolved but that
+// has not been defined yet. Scripts can never observe it.
+
+#ifdef NAN_BOXING
+
+// A value is a 64-bit double. Anything that isn't a number is encoded in the
+// unused bits of a quiet NaN: objects set the sign bit and store the pointer in
+// the low 48 bits, the singletons use a small tag in the lowest bits.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE 3 // 11
+#define TAG_UNDEFINED 4 // 100
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value) numToValue(value)
+#define OBJ_VAL(object) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// type punning through memcpy, which compilers turn into a plain register move
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 #define BOOL_VAL(value) ((Value){ VAL_BOOL, { .boolean = value } })
 #define NIL_VAL ((Value){ VAL_NIL, { .number = 0 }})
+#define UNDEFINED_VAL ((Value){ VAL_UNDEFINED, { .number = 0 }})
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
 #define OBJ_VAL(object) ((Value){ VAL_OBJ, { .obj = (Obj*)object } })
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -17,14 +79,12 @@
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJ(value) ((value).as.obj)
 
-typedef struct Obj Obj;
-typedef struct ObjString ObjString;
-
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -36,6 +96,8 @@ typedef struct {
     } as;
 } Value;
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
@@ -43,9 +105,9 @@ typedef struct {
 } ValueArray;
 
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 bool valuesEqual(Value a, Value b);
-void printValue(Value value);
+void printValue(FILE* file, Value value);
 
 #endif
@@ -1,233 +1,652 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
 
-static void resetStack();
-static InterpretResult run();
-static Value peek(int distance);
+static void resetStack(VM* vm);
+static InterpretResult run(VM* vm);
+static int instructionOffset(VM* vm);
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm);
+#endif
+#ifdef DEBUG_OPCODE_STATS
+static void countOpcode(VM* vm);
+#endif
+static Value peek(VM* vm, int distance);
 static bool isFalsey(Value value);
-static void concatenate();
-static void runtimeError(const char* format, ...);
+static bool add(VM* vm);
+static bool addN(VM* vm, int count);
+static bool concatenate(VM* vm);
+static void joinStrings(VM* vm, int count, int length);
+static void flattenStack(VM* vm, int count);
+static void runtimeError(VM* vm, const char* format, ...);
 
-VM vm;
+void initVM(VM* vm) {
+    initAllocator(&vm->allocator);
+    resetStack(vm);
+    vm->chunk = NULL;
+    vm->compilingChunk = NULL;
+    vm->image = NULL;
+    vm->imageSize = 0;
+    vm->output = stdout;
+    vm->errors = stderr;
+    vm->objects = NULL;
+    vm->frozen = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+#ifdef NURSERY
+    vm->nursery = malloc(NURSERY_SIZE);
+    if (vm->nursery == NULL) {
+        exit(1);
+    }
+    vm->nurseryTop = vm->nursery;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+#endif
+    memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+    vm->optimizationLevel = 1;
+    vm->shareStrings = true;
+#ifdef DEBUG_OPCODE_STATS
+    memset(vm->opcodeCounts, 0, sizeof(vm->opcodeCounts));
+    memset(vm->opcodePairs, 0, sizeof(vm->opcodePairs));
+#endif
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    initTable(&vm->strings);
+}
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+void freeVM(VM* vm) {
+#ifdef DEBUG_OPCODE_STATS
+    printOpcodeStats(vm);
+#endif
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    freeTable(vm, &vm->strings);
+    freeObjects(vm);
+#ifdef NURSERY
+    free(vm->nursery);
+#endif
+    freeImage(vm);
+    freeAllocator(&vm->allocator);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+// Forgets the globals, strings and objects the scripts run so far left behind,
+// but keeps the memory they were in: the tables and arrays keep their capacity
+// and the objects go back to the allocator's free lists. It is much cheaper
+// than freeVM() and initVM(), and leaves the VM as good as new.
+void resetVM(VM* vm) {
+    resetStack(vm);
+    vm->chunk = NULL;
+    clearTable(vm, &vm->globalSlots);
+    vm->globalNames.count = 0;
+    vm->globalValues.count = 0;
+    clearTable(vm, &vm->strings);
+    freeHeap(vm);
 }
 
-InterpretResult interpret(const char* source) {
+InterpretResult interpret(VM* vm, const char* source) {
     Chunk chunk;
     initChunk(&chunk);
 
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
+    if (!compile(vm, source, &chunk)) {
+        freeChunk(vm, &chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    InterpretResult result = interpretChunk(vm, &chunk);
 
-    InterpretResult result = run();
+    freeChunk(vm, &chunk);
+    return result;
+}
 
-    freeChunk(&chunk);
+// Runs an already compiled chunk. The chunk is still owned by the caller.
+InterpretResult interpretChunk(VM* vm, Chunk* chunk) {
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
+#ifdef DEBUG_OPCODE_STATS
+    vm->previousOpcode = -1;
+#endif
+
+    InterpretResult result = run(vm);
+    vm->chunk = NULL; // the caller may free the chunk, so it stops being a root
     return result;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+// Returns the slot of a global variable, giving it a new (undefined) slot the
+// first time the name is seen.
+int globalSlot(VM* vm, ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(vm, OBJ_VAL(name)); // the name isn't reachable until it is in globalNames
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    pop(vm);
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    int index = vm->globalValues.count - 1;
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(index));
+    return index;
+}
+
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+static InterpretResult run(VM* vm) {
+#ifdef DIRECT_THREADED
+#define READ_BYTE() ((uint8_t)(vm->tip++)->operand)
+#define READ_LONG() \
+    (vm->tip += 3, \
+        (uint32_t)((vm->tip[-3].operand << 16) | (vm->tip[-2].operand << 8) | vm->tip[-1].operand))
+#else
+#define READ_BYTE() (*vm->ip++)
+#define READ_LONG() \
+    (vm->ip += 3, (uint32_t)((vm->ip[-3] << 16) | (vm->ip[-2] << 8) | vm->ip[-1]))
+#endif
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (vm->chunk->constants.values[READ_LONG()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm->globalNames.values[slot])
+#define CHECK_DEFINED(slot) \
+    do { \
+        if (IS_UNDEFINED(vm->globalValues.values[slot])) { \
+            runtimeError(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot)); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtimeError(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, valueType(a op b)); \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+#define TRACE_EXECUTION() traceExecution(vm)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_OPCODE_STATS
+#define COUNT_OPCODE() countOpcode(vm)
+#else
+#define COUNT_OPCODE() do { } while (false)
+#endif
+
+    // With computed gotos every handler jumps straight to the next one, so
+    // each opcode gets its own indirect branch. The switch below is then only
+    // there to hold the labels; it is never entered.
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&TARGET_OP_CONSTANT_LONG,
+        [OP_TRUE] = &&TARGET_OP_TRUE,
+        [OP_FALSE] = &&TARGET_OP_FALSE,
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_CONCAT_N] = &&TARGET_OP_CONCAT_N,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_EQUAL] = &&TARGET_OP_EQUAL,
+        [OP_GREATER] = &&TARGET_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+        [OP_LESS] = &&TARGET_OP_LESS,
+        [OP_LESS_EQUAL] = &&TARGET_OP_LESS_EQUAL,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&TARGET_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+        [OP_GET_GLOBAL_LONG] = &&TARGET_OP_GET_GLOBAL_LONG,
+        [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_POPN] = &&TARGET_OP_POPN,
+        [OP_PRINT] = &&TARGET_OP_PRINT,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+        [OP_SET_GLOBAL_LONG] = &&TARGET_OP_SET_GLOBAL_LONG,
+        [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+        [OP_CONSTANT_DEFINE_GLOBAL] = &&TARGET_OP_CONSTANT_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL_CONSTANT_ADD] = &&TARGET_OP_GET_GLOBAL_CONSTANT_ADD,
+        [OP_SET_GLOBAL_POP] = &&TARGET_OP_SET_GLOBAL_POP,
+        [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+    };
+#define CASE(opcode) case opcode: TARGET_##opcode
+#ifdef DIRECT_THREADED
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        COUNT_OPCODE(); \
+        goto *(vm->tip++)->handler; \
+    } while (false)
+#else
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        COUNT_OPCODE(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#endif
+#else
+#define CASE(opcode) case opcode
+#define DISPATCH() break
+#endif
+
+#ifdef DIRECT_THREADED
+    // pre-decode the chunk once: opcodes become handler addresses, operands are copied over
+    if (vm->chunk->threadedCode == NULL) {
+        ThreadedOp* threadedCode = ALLOCATE(vm, ThreadedOp, vm->chunk->count);
+        for (int offset = 0; offset < vm->chunk->count;) {
+            uint8_t instruction = vm->chunk->code[offset];
+            int size = instructionSize(instruction);
+            threadedCode[offset].handler = dispatchTable[instruction];
+            for (int i = 1; i < size; i++) {
+                threadedCode[offset + i].operand = vm->chunk->code[offset + i];
+            }
+            offset += size;
         }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int) (vm.ip - vm.chunk->code));
+        vm->chunk->threadedCode = threadedCode;
+    }
+    vm->tip = vm->chunk->threadedCode;
+#endif
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
 #endif
 
+    for (;;) {
+        TRACE_EXECUTION();
+        COUNT_OPCODE();
+
         uint8_t instruction;
         // instruction decoding / dispatching
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
+            CASE(OP_CONSTANT): {
                 Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
+                push(vm, constant);
+                DISPATCH();
+            }
+            CASE(OP_CONSTANT_LONG): {
+                Value constant = READ_CONSTANT_LONG();
+                push(vm, constant);
+                DISPATCH();
+            }
+            CASE(OP_TRUE):
+                push(vm, BOOL_VAL(true));
+                DISPATCH();
+            CASE(OP_FALSE):
+                push(vm, BOOL_VAL(false));
+                DISPATCH();
+            CASE(OP_NIL):
+                push(vm, NIL_VAL);
+                DISPATCH();
             // operators
-            case OP_ADD: {
-                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
+            CASE(OP_ADD):
+                if (!add(vm)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
-            }
-            case OP_DIVIDE:
+                DISPATCH();
+            CASE(OP_CONCAT_N):
+                if (!addN(vm, READ_BYTE())) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                DISPATCH();
+            CASE(OP_DIVIDE):
                 BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER:
+                DISPATCH();
+            CASE(OP_EQUAL): {
+                flattenStack(vm, 2);
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_GREATER):
                 BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
+                DISPATCH();
+            CASE(OP_GREATER_EQUAL):
+                BINARY_OP(BOOL_VAL, >=);
+                DISPATCH();
+            CASE(OP_LESS):
                 BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_MULTIPLY:
+                DISPATCH();
+            CASE(OP_LESS_EQUAL):
+                BINARY_OP(BOOL_VAL, <=);
+                DISPATCH();
+            CASE(OP_MULTIPLY):
                 BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+                DISPATCH();
+            CASE(OP_NEGATE):
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_SUBTRACT:
+                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                DISPATCH();
+            CASE(OP_NOT):
+                push(vm, BOOL_VAL(isFalsey(pop(vm))));
+                DISPATCH();
+            CASE(OP_NOT_EQUAL): {
+                flattenStack(vm, 2);
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(!valuesEqual(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT):
                 BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop(); // the value is popped after it is used.
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_POP:
-                pop();
-                break;
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_RETURN:
+                DISPATCH();
+            CASE(OP_DEFINE_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                vm->globalValues.values[slot] = peek(vm, 0);
+                pop(vm); // the value is popped after it is used.
+                DISPATCH();
+            }
+            CASE(OP_DEFINE_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                vm->globalValues.values[slot] = peek(vm, 0);
+                pop(vm);
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                CHECK_DEFINED(slot);
+                push(vm, vm->globalValues.values[slot]);
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                CHECK_DEFINED(slot);
+                push(vm, vm->globalValues.values[slot]);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                push(vm, vm->stack[slot]);
+                DISPATCH();
+            }
+            CASE(OP_POP):
+                pop(vm);
+                DISPATCH();
+            CASE(OP_POPN):
+                vm->stackTop -= READ_BYTE();
+                DISPATCH();
+            CASE(OP_PRINT):
+                flattenStack(vm, 1);
+                printValue(vm->output, pop(vm));
+                fputc('\n', vm->output);
+                DISPATCH();
+            CASE(OP_RETURN):
                 // exit interpreter
                 return INTERPRET_OK;
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            CASE(OP_SET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                CHECK_DEFINED(slot);
                 // the value is not popped because assignment is an expression
-                break;
+                vm->globalValues.values[slot] = peek(vm, 0);
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                CHECK_DEFINED(slot);
+                vm->globalValues.values[slot] = peek(vm, 0);
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL): {
+                uint8_t slot = READ_BYTE();
+                vm->stack[slot] = peek(vm, 0); // assignment is an expression, so the value stays on the stack
+                DISPATCH();
+            }
+            // superinstructions
+            CASE(OP_CONSTANT_DEFINE_GLOBAL): {
+                Value constant = READ_CONSTANT();
+                vm->globalValues.values[READ_BYTE()] = constant;
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL_CONSTANT_ADD): {
+                uint8_t slot = READ_BYTE();
+                CHECK_DEFINED(slot);
+                Value value = vm->globalValues.values[slot];
+                Value constant = READ_CONSTANT();
+                if (IS_NUMBER(value) && IS_NUMBER(constant)) {
+                    push(vm, NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant)));
+                } else {
+                    push(vm, value);
+                    push(vm, constant);
+                    if (!add(vm)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL_POP): {
+                uint8_t slot = READ_BYTE();
+                CHECK_DEFINED(slot);
+                vm->globalValues.values[slot] = pop(vm);
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL_POP): {
+                uint8_t slot = READ_BYTE();
+                vm->stack[slot] = pop(vm);
+                DISPATCH();
             }
         }
     }
 
 #undef READ_BYTE
+#undef READ_LONG
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef GLOBAL_NAME
+#undef CHECK_DEFINED
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef COUNT_OPCODE
+#undef CASE
+#undef DISPATCH
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+// Returns the offset of the next instruction to execute.
+static int instructionOffset(VM* vm) {
+#ifdef DIRECT_THREADED
+    return (int)(vm->tip - vm->chunk->threadedCode);
+#else
+    return (int)(vm->ip - vm->chunk->code);
+#endif
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm) {
+    printf("          ");
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(stdout, *slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(vm, vm->chunk, instructionOffset(vm));
+}
+#endif
+
+#ifdef DEBUG_OPCODE_STATS
+static void countOpcode(VM* vm) {
+    uint8_t instruction = vm->chunk->code[instructionOffset(vm)];
+    vm->opcodeCounts[instruction]++;
+    if (vm->previousOpcode != -1) {
+        vm->opcodePairs[vm->previousOpcode][instruction]++;
+    }
+    vm->previousOpcode = instruction;
+}
+#endif
+
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+// Adds the two values on top of the stack: numbers are summed, strings are
+// concatenated. Reports a runtime error for anything else.
+static bool add(VM* vm) {
+    if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        double b = AS_NUMBER(pop(vm));
+        double a = AS_NUMBER(pop(vm));
+        push(vm, NUMBER_VAL(a + b));
+    } else if (IS_ANY_STRING(peek(vm, 0)) && IS_ANY_STRING(peek(vm, 1))) {
+        return concatenate(vm);
+    } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
 
-    int length = a->length + b->length; // length does not include '\0'
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Adds the top count values on the stack, left to right, for a chain of +.
+// Numbers are summed and short strings are joined in one go; anything else is
+// added a pair at a time, so that errors and long strings behave exactly as
+// they would with one OP_ADD per +.
+static bool addN(VM* vm, int count) {
+    Value* operands = vm->stackTop - count;
+    bool numbers = true;
+    bool strings = true;
+    long long length = 0; // up to CONCAT_MAX_OPERANDS lengths that each fit in an int
+    for (int i = 0; i < count; i++) {
+        numbers = numbers && IS_NUMBER(operands[i]);
+        strings = strings && IS_ANY_STRING(operands[i]);
+        if (strings) {
+            length += stringLength(AS_OBJ(operands[i]));
+        }
+    }
+
+    if (numbers) {
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; i++) {
+            sum += AS_NUMBER(operands[i]);
+        }
+        vm->stackTop = operands;
+        push(vm, NUMBER_VAL(sum));
+        return true;
+    }
+
+#ifdef ROPES
+    // a chain with a rope in it is at least this long too
+    if (strings && length < ROPE_MIN_LENGTH) {
+#else
+    if (strings && length <= INT_MAX) {
+#endif
+        joinStrings(vm, count, (int)length);
+        return true;
+    }
+
+    for (int i = 1; i < count; i++) {
+        push(vm, operands[0]);
+        push(vm, operands[i]);
+        if (!add(vm)) {
+            return false;
+        }
+        operands[0] = pop(vm);
+    }
+    vm->stackTop = operands + 1;
+    return true;
+}
+
+static bool concatenate(VM* vm) {
+    // the operands stay on the stack until the result exists, so a collection
+    // started by allocating it can't free them
+    long long length = (long long)stringLength(AS_OBJ(peek(vm, 0))) + stringLength(AS_OBJ(peek(vm, 1))); // length does not include '\0'
+    if (length > INT_MAX) {
+        runtimeError(vm, "String is too long.");
+        return false;
+    }
+
+#ifdef ROPES
+    // long results are joined lazily, so a string grown one piece at a time
+    // copies each piece once, when it is flattened, instead of on every step
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = newRope(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+        pop(vm);
+        pop(vm);
+        push(vm, OBJ_VAL(rope));
+        return true;
+    }
+#endif
+
+    // a shorter result can only come from two strings
+    joinStrings(vm, 2, (int)length);
+    return true;
+}
+
+// Replaces the top count strings on the stack with one string of their
+// characters, length long, which is allocated, hashed and interned once.
+static void joinStrings(VM* vm, int count, int length) {
+    ObjString* result = newString(vm, length);
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    // a minor collection may have moved the operands, so they are read now
+    char* end = result->chars;
+    for (Value* operand = vm->stackTop - count; operand < vm->stackTop; operand++) {
+        ObjString* string = AS_STRING(*operand);
+        memcpy(end, string->chars, string->length);
+        end += string->length;
+    }
+
+    result = internString(vm, result);
+    vm->stackTop -= count;
+    push(vm, OBJ_VAL(result));
+}
+
+// Replaces ropes in the top count stack slots with their strings, for the
+// instructions that need the characters or the interned identity.
+static void flattenStack(VM* vm, int count) {
+    for (int i = 0; i < count; i++) {
+        if (IS_ROPE(peek(vm, i))) {
+            ObjString* string = flattenRope(vm, AS_ROPE(peek(vm, i))); // the rope stays on the stack meanwhile
+            vm->stackTop[-1 - i] = OBJ_VAL(string);
+        }
+    }
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->errors, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->errors);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    size_t instruction = instructionOffset(vm) - 1;
+    int line = getLine(vm->chunk, (int)instruction);
+    fprintf(vm->errors, "[line %d] in script\n", line);
+    resetStack(vm);
 }
@@ -1,21 +1,73 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "allocator.h"
 #include "chunk.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// room for every local a chunk can have, with as many temporaries on top
+#define STACK_MAX (UINT8_COUNT * 2)
 
+// what the collectors have done so far, for the benchmarks
 typedef struct {
+    uint64_t bytesRequested; // by reallocate() and the nursery together
+    uint64_t allocations; // new blocks from reallocate(), the nursery and promotion
+    uint64_t majorCollections;
+    uint64_t majorPauseNs;
+    uint64_t maxMajorPauseNs;
+    uint64_t minorCollections;
+    uint64_t minorPauseNs;
+    uint64_t maxMinorPauseNs;
+    uint64_t promotedBytes; // copied out of the nursery by minor collections
+} GcStats;
+
+// Everything one interpreter owns. Nothing in a VM is shared with another one
+// except the pool of shared strings, so separate VMs can run on separate
+// threads at once.
+struct VM {
     Chunk* chunk;
     uint8_t* ip; // instruction pointer or program counter (PC)
+#ifdef DIRECT_THREADED
+    ThreadedOp* tip; // instruction pointer into chunk->threadedCode
+#endif
     Value stack[STACK_MAX];
     Value* stackTop;
-    Table globals; // global variables
+    Table globalSlots; // maps global variable names to their slot
+    ValueArray globalNames; // global variable names, indexed by slot
+    ValueArray globalValues; // global variable values, indexed by slot
     Table strings; // string interning
     Obj* objects; // head to the objects linked list
-} VM;
+    Obj* frozen; // objects freezeHeap() took off the list: marked for good and never swept
+    size_t bytesAllocated; // bytes currently allocated through reallocate()
+    size_t nextGC; // collect when bytesAllocated goes past this
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack; // marked objects whose references haven't been traced yet
+#ifdef NURSERY
+    uint8_t* nursery; // the young generation, NURSERY_SIZE bytes
+    uint8_t* nurseryTop; // where the next young object goes
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered; // old objects that refer to young ones
+#endif
+    Chunk* compilingChunk; // the chunk compile() is writing, kept alive by the collector
+    Allocator allocator;
+    void* image; // the heap image the VM was loaded from, mapped for as long as it lives
+    size_t imageSize;
+    GcStats gcStats;
+    FILE* output; // where print writes, stdout unless the VM's user points it elsewhere
+    FILE* errors; // where compile and runtime errors go, stderr by default
+    int optimizationLevel; // 0 runs the compiler's output as is, 1 runs the optimizer over it
+    // whether copySharedString() adds the strings it doesn't find to the shared
+    // pool, which never frees them; off in VMs that outlive the scripts they run
+    bool shareStrings;
+#ifdef DEBUG_OPCODE_STATS
+    uint64_t opcodeCounts[UINT8_COUNT];
+    uint64_t opcodePairs[UINT8_COUNT][UINT8_COUNT]; // [previous][current]
+    int previousOpcode; // -1 at the start of a chunk
+#endif
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -23,12 +75,13 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+void freeVM(VM* vm);
+void resetVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretChunk(VM* vm, Chunk* chunk);
+int globalSlot(VM* vm, ObjString* name);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif
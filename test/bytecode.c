@@ -0,0 +1,112 @@
+// Hands runBuffer() bytecode the compiler would never write, the way a client of
+// --serve could, and fails unless the verifier turns away the chunks that would
+// run past the end of the stack and lets through the ones that just fit.
+//
+//   clox_bytecode_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "object.h"
+#include "script.h"
+#include "vm.h"
+
+#define CONCAT_OPERANDS 255
+#define BYTECODE_PATH "clox_bytecode_test.loxc"
+
+static bool check(const char* name, int below, int expectedStatus, const char* expectedError);
+static void writeConcat(VM* vm, Chunk* chunk, int below);
+static char* readBytes(const char* path, size_t* size);
+
+static VM vm;
+
+int main() {
+    bool passed = true;
+
+    // OP_CONCAT_N adds a string and nils a pair at a time, so the stack has to
+    // hold two values on top of its operands
+    passed = check("concat at the stack limit", STACK_MAX - CONCAT_OPERANDS - 2,
+                   EXIT_RUNTIME_ERROR, "Operands must be two numbers or two strings.\n[line 1] in script\n") && passed;
+    passed = check("concat past the stack limit", STACK_MAX - CONCAT_OPERANDS - 1,
+                   EXIT_IO_ERROR, "Bytecode file is not valid.\n") && passed;
+    passed = check("concat with its operands past the stack limit", STACK_MAX - CONCAT_OPERANDS + 1,
+                   EXIT_IO_ERROR, "Bytecode file is not valid.\n") && passed;
+
+    remove(BYTECODE_PATH);
+    return passed ? 0 : 1;
+}
+
+// Runs a chunk that leaves below nils on the stack before the OP_CONCAT_N, and
+// reports whether it exits with the status and the errors expected.
+static bool check(const char* name, int below, int expectedStatus, const char* expectedError) {
+    initVM(&vm);
+    char* errors = NULL;
+    size_t errorsLength = 0;
+    vm.errors = openCapture(&errors, &errorsLength);
+
+    // the chunk is a root until it is written, the way it is while compile()
+    // builds it, so growing it can't free the string constant
+    Chunk chunk;
+    initChunk(&chunk);
+    vm.compilingChunk = &chunk;
+    writeConcat(&vm, &chunk, below);
+    if (!writeBytecode(&vm, &chunk, "", __FILE__, BYTECODE_PATH)) {
+        fprintf(stderr, "%s: could not write \"%s\".\n", name, BYTECODE_PATH);
+        exit(1);
+    }
+    vm.compilingChunk = NULL;
+    freeChunk(&vm, &chunk);
+
+    size_t size;
+    char* data = readBytes(BYTECODE_PATH, &size);
+    int status = runBuffer(&vm, data, size, name);
+    free(data);
+    fclose(vm.errors);
+    vm.errors = stderr;
+    freeVM(&vm);
+
+    bool passed = status == expectedStatus && strcmp(errors, expectedError) == 0;
+    if (!passed) {
+        fprintf(stderr, "%s: expected status %d and:\n%sgot status %d and:\n%s",
+                name, expectedStatus, expectedError, status, errors);
+    }
+    free(errors);
+    return passed;
+}
+
+static void writeConcat(VM* vm, Chunk* chunk, int below) {
+    for (int i = 0; i < below; i++) {
+        writeChunk(vm, chunk, OP_NIL, 1);
+    }
+    int constant = addConstant(vm, chunk, OBJ_VAL(copyString(vm, "string", 6)));
+    writeChunk(vm, chunk, OP_CONSTANT, 1);
+    writeChunk(vm, chunk, (uint8_t)constant, 1);
+    for (int i = 1; i < CONCAT_OPERANDS; i++) {
+        writeChunk(vm, chunk, OP_NIL, 1);
+    }
+    writeChunk(vm, chunk, OP_CONCAT_N, 1);
+    writeChunk(vm, chunk, CONCAT_OPERANDS, 1);
+    writeChunk(vm, chunk, OP_POP, 1);
+    writeChunk(vm, chunk, OP_RETURN, 1);
+}
+
+static char* readBytes(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(1);
+    }
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* data = malloc(*size);
+    if (data == NULL || fread(data, 1, *size, file) < *size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(1);
+    }
+    fclose(file);
+    return data;
+}
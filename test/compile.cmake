@@ -0,0 +1,62 @@
+# Compiles a script with --compile and runs the bytecode file, then checks that
+# a file whose source has changed since runs the source instead, and that files
+# that are cut short or come from another version of clox are turned away.
+#
+#   cmake -DCLOX=path/to/clox -DWORK=path/to/scratch -P compile.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/expect.cmake)
+start_work()
+get_filename_component(work ${WORK} REALPATH)
+
+file(WRITE ${WORK}/hello.lox "var greeting = \"hello\";\nprint greeting + \" world\";\n")
+expect_run("--compile" "" "" 0 --compile hello.lox)
+expect_run("bytecode" "hello world\n" "" 0 hello.loxc)
+expect_run("--compile -o" "" "" 0 --compile hello.lox -o renamed.loxc)
+expect_run("bytecode with -o" "hello world\n" "" 0 renamed.loxc)
+
+# the bytecode file keeps the hash of the source it was compiled from
+file(WRITE ${WORK}/hello.lox "print \"changed\";\n")
+expect_run("stale bytecode" "changed\n"
+    "\"hello.loxc\" is out of date, running \"${work}/hello.lox\" instead.\n" 0
+    hello.loxc)
+
+# cut the file short in its last global name and in its header, give it a
+# version no clox has, and point its first instruction, the OP_CONSTANT of
+# the print, past the constants. The code starts on the 4-byte boundary after
+# the 40-byte header and the source path
+expect_run("--compile again" "" "" 0 --compile hello.lox)
+file(READ ${WORK}/hello.loxc bytes HEX)
+string(LENGTH ${bytes} size)
+math(EXPR size "${size} / 2 - 4")
+execute_process(COMMAND head -c ${size} hello.loxc
+    WORKING_DIRECTORY ${WORK} OUTPUT_FILE ${WORK}/truncated.loxc)
+execute_process(COMMAND head -c 20 hello.loxc
+    WORKING_DIRECTORY ${WORK} OUTPUT_FILE ${WORK}/header.loxc)
+execute_process(COMMAND sh -c "cp hello.loxc version.loxc && printf '\\377' | dd of=version.loxc bs=1 seek=4 conv=notrunc 2>/dev/null"
+    WORKING_DIRECTORY ${WORK})
+string(LENGTH "${work}/hello.lox" pathlength)
+math(EXPR operand "(40 + ${pathlength} + 1 + 3) / 4 * 4 + 1")
+execute_process(COMMAND sh -c "cp hello.loxc operand.loxc && printf '\\377' | dd of=operand.loxc bs=1 seek=${operand} conv=notrunc 2>/dev/null"
+    WORKING_DIRECTORY ${WORK})
+
+expect_run("truncated bytecode" "changed\n"
+    "Bytecode file is truncated.\nRunning \"${work}/hello.lox\" instead.\n" 0
+    truncated.loxc)
+expect_run("bytecode from another version" ""
+    "\"version.loxc\" was compiled by another version of clox.\n" 74
+    version.loxc)
+expect_run("bytecode with a damaged operand" "changed\n"
+    "Bytecode file is not valid.\nRunning \"${work}/hello.lox\" instead.\n" 0
+    operand.loxc)
+
+# without the source there is nothing to fall back on
+file(REMOVE ${WORK}/hello.lox)
+expect_run("truncated bytecode without its source" ""
+    "Bytecode file is truncated.\n" 74
+    truncated.loxc)
+expect_run("bytecode with a damaged operand without its source" ""
+    "Bytecode file is not valid.\n" 74
+    operand.loxc)
+expect_run("truncated header" ""
+    "\"header.loxc\" is not a bytecode file.\n" 74
+    header.loxc)
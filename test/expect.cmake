@@ -0,0 +1,33 @@
+# What the tests of the clox command share. Each one runs in a scratch
+# directory of its own, WORK, which start_work() empties.
+#
+# expect_run(name output errors status args...) runs CLOX with the arguments in
+# WORK and fails unless it prints the output and the errors given and exits with
+# the status. The times and the memory sizes in the reports of --jobs and
+# --prefork change from run to run, so they are compared as T s, R scripts/s
+# and M KB.
+
+function(start_work)
+    file(REMOVE_RECURSE ${WORK})
+    file(MAKE_DIRECTORY ${WORK})
+endfunction()
+
+function(expect_run name expectedoutput expectederrors expectedstatus)
+    execute_process(
+        COMMAND ${CLOX} ${ARGN}
+        WORKING_DIRECTORY ${WORK}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+        RESULT_VARIABLE status
+    )
+    string(REGEX REPLACE "[0-9]+\\.[0-9]+ scripts/s" "R scripts/s" errors "${errors}")
+    string(REGEX REPLACE "[0-9]+\\.[0-9]+ s" "T s" errors "${errors}")
+    string(REGEX REPLACE "-?[0-9]+ KB" "M KB" errors "${errors}")
+
+    foreach(part output errors status)
+        if(NOT "${${part}}" STREQUAL "${expected${part}}")
+            message(FATAL_ERROR "${name}: the ${part} is not what it should be.\n"
+                "expected:\n${expected${part}}\ngot:\n${${part}}")
+        endif()
+    endforeach()
+endfunction()
@@ -0,0 +1,42 @@
+# Saves the heap a prelude leaves behind with --dump-image and runs scripts
+# that start from it with --image, including one that saves the heap again.
+# Checks too that a failed script saves nothing and that images cut short are
+# turned away.
+#
+#   cmake -DCLOX=path/to/clox -DWORK=path/to/scratch -P image.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/expect.cmake)
+start_work()
+
+file(WRITE ${WORK}/prelude.lox "var greeting = \"hello\";\nvar count = 41;\nprint \"prelude\";\n")
+file(WRITE ${WORK}/count.lox "count = count + 1;\nprint greeting + \" world\";\nprint count;\n")
+file(WRITE ${WORK}/runtime.lox "var lost = \"lost\";\nprint -lost;\n")
+
+expect_run("--dump-image" "prelude\n" "" 0 --dump-image prelude.image prelude.lox)
+expect_run("--image" "hello world\n42\n" "" 0 --image prelude.image count.lox)
+expect_run("--image after another run" "hello world\n42\n" "" 0 --image prelude.image count.lox)
+expect_run("--image with --dump-image" "hello world\n42\n" "" 0
+    --image prelude.image --dump-image count.image count.lox)
+expect_run("--image of an image" "hello world\n43\n" "" 0 --image count.image count.lox)
+expect_run("-O0 --image" "hello world\n42\n" "" 0 -O0 --image prelude.image count.lox)
+
+expect_run("--dump-image after a runtime error" ""
+    "Operand must be a number.\n[line 2] in script\n" 70
+    --dump-image runtime.image runtime.lox)
+if(EXISTS ${WORK}/runtime.image)
+    message(FATAL_ERROR "a script that failed saved its heap.")
+endif()
+
+file(READ ${WORK}/prelude.image bytes HEX)
+string(LENGTH ${bytes} size)
+math(EXPR size "${size} / 2 - 8")
+execute_process(COMMAND head -c ${size} prelude.image
+    WORKING_DIRECTORY ${WORK} OUTPUT_FILE ${WORK}/truncated.image)
+execute_process(COMMAND head -c 16 prelude.image
+    WORKING_DIRECTORY ${WORK} OUTPUT_FILE ${WORK}/header.image)
+expect_run("truncated image" "" "\"truncated.image\" is truncated.\n" 74
+    --image truncated.image count.lox)
+expect_run("truncated header" "" "\"header.image\" is not a heap image.\n" 74
+    --image header.image count.lox)
+expect_run("missing image" "" "Could not open file \"missing.image\".\n" 74
+    --image missing.image count.lox)
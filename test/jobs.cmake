@@ -0,0 +1,42 @@
+# Runs scripts on a pool of workers with --jobs and checks that what they print
+# comes out in the order the scripts were given, even when the first one takes
+# the longest, and that the command exits with the status of the first script
+# in that order that failed.
+#
+#   cmake -DCLOX=path/to/clox -DWORK=path/to/scratch -P jobs.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/expect.cmake)
+start_work()
+
+# Lox has no loops yet, so the slow script is unrolled, doubling up to 16384
+# statements
+set(body "x = x + 1;\n")
+foreach(i RANGE 13)
+    set(body "${body}${body}")
+endforeach()
+file(WRITE ${WORK}/slow.lox "var x = 0;\n${body}print x;\n")
+file(WRITE ${WORK}/runtime.lox "print \"runtime\";\nprint 1 + \"runtime\";\n")
+file(WRITE ${WORK}/fast.lox "print \"fast\";\n")
+file(WRITE ${WORK}/compile.lox "print;\n")
+
+expect_run("--jobs" "16384\nfast\n"
+    "[1/2] slow.lox: ok, T s\n[2/2] fast.lox: ok, T s\n2 scripts, 0 failed, T s on 2 workers, R scripts/s\n" 0
+    --jobs 2 slow.lox fast.lox)
+
+string(CONCAT errors
+    "[1/5] slow.lox: ok, T s\n"
+    "Operands must be two numbers or two strings.\n[line 2] in script\n[2/5] runtime.lox: exit 70, T s\n"
+    "[3/5] fast.lox: ok, T s\n"
+    "[line 1] Error at ';': Expect expression.\n[4/5] compile.lox: exit 65, T s\n"
+    "Could not open file \"missing.lox\".\n[5/5] missing.lox: exit 74, T s\n"
+    "5 scripts, 3 failed, T s on 3 workers, R scripts/s\n")
+expect_run("--jobs with failures" "16384\nruntime\nfast\n" "${errors}" 70
+    --jobs 3 slow.lox runtime.lox fast.lox compile.lox missing.lox)
+
+string(CONCAT errors
+    "[line 1] Error at ';': Expect expression.\n[1/3] compile.lox: exit 65, T s\n"
+    "[2/3] fast.lox: ok, T s\n"
+    "Operands must be two numbers or two strings.\n[line 2] in script\n[3/3] runtime.lox: exit 70, T s\n"
+    "3 scripts, 2 failed, T s on 3 workers, R scripts/s\n")
+expect_run("--jobs with more workers than scripts" "fast\nruntime\n" "${errors}" 65
+    --jobs 8 compile.lox fast.lox runtime.lox)
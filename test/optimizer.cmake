@@ -0,0 +1,39 @@
+# Runs one script with and without the optimizer and fails unless both runs
+# print what the files next to the script expect: script.out holds the output,
+# script.err the errors and script.status the exit status. A missing .err
+# expects no errors and a missing .status expects 0. The opcode counts a
+# CLOX_OPCODE_STATS build adds to the errors when the VM is freed are left
+# out, since the optimizer is meant to change them.
+#
+#   cmake -DCLOX=path/to/clox -DSCRIPT=path/to/script.lox -P optimizer.cmake
+
+get_filename_component(directory ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+set(expected ${directory}/${name})
+
+file(READ ${expected}.out expectedoutput)
+set(expectederrors "")
+if(EXISTS ${expected}.err)
+    file(READ ${expected}.err expectederrors)
+endif()
+set(expectedstatus 0)
+if(EXISTS ${expected}.status)
+    file(STRINGS ${expected}.status expectedstatus)
+endif()
+
+foreach(level 0 1)
+    execute_process(
+        COMMAND ${CLOX} -O${level} ${SCRIPT}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+        RESULT_VARIABLE status
+    )
+    string(REGEX REPLACE "== opcode counts .*$" "" errors "${errors}")
+
+    foreach(part output errors status)
+        if(NOT "${${part}}" STREQUAL "${expected${part}}")
+            message(FATAL_ERROR "${SCRIPT}: the ${part} at -O${level} is not what ${name} expects.\n"
+                "expected:\n${expected${part}}\ngot:\n${${part}}")
+        endif()
+    endforeach()
+endforeach()
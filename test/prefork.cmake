@@ -0,0 +1,46 @@
+# Runs a prelude once and scripts in workers forked from the heap it leaves
+# behind with --prefork, and checks what each of them prints, that a change one
+# makes to the heap stays in its own worker, and that the command exits with
+# the status of the first script that failed, or of the prelude when it fails.
+#
+#   cmake -DCLOX=path/to/clox -DWORK=path/to/scratch -P prefork.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/expect.cmake)
+start_work()
+
+file(WRITE ${WORK}/prelude.lox "var greeting = \"hello\";\nprint \"prelude\";\n")
+file(WRITE ${WORK}/change.lox "greeting = \"changed\";\nprint greeting;\n")
+file(WRITE ${WORK}/greet.lox "print greeting + \" world\";\n")
+file(WRITE ${WORK}/runtime.lox "print -greeting;\n")
+file(WRITE ${WORK}/compile.lox "print;\n")
+
+string(CONCAT errors
+    "prelude.lox: T s, M KB resident\n"
+    "[1/2] change.lox: ok, T s, M KB private, M KB shared\n"
+    "[2/2] greet.lox: ok, T s, M KB private, M KB shared\n"
+    "2 scripts, 0 failed, T s on 1 workers, R scripts/s\n"
+    "worker memory: M KB private on average, M KB at most, M KB shared on average\n")
+expect_run("--prefork" "prelude\nchanged\nhello world\n" "${errors}" 0
+    --prefork prelude.lox --jobs 1 change.lox greet.lox)
+
+string(CONCAT errors
+    "prelude.lox: T s, M KB resident\n"
+    "[1/5] greet.lox: ok, T s, M KB private, M KB shared\n"
+    "Operand must be a number.\n[line 1] in script\n"
+    "[2/5] runtime.lox: exit 70, T s, M KB private, M KB shared\n"
+    "[line 1] Error at ';': Expect expression.\n"
+    "[3/5] compile.lox: exit 65, T s, M KB private, M KB shared\n"
+    "Could not open file \"missing.lox\".\n"
+    "[4/5] missing.lox: exit 74, T s, M KB private, M KB shared\n"
+    "[5/5] greet.lox: ok, T s, M KB private, M KB shared\n"
+    "5 scripts, 3 failed, T s on 2 workers, R scripts/s\n"
+    "worker memory: M KB private on average, M KB at most, M KB shared on average\n")
+expect_run("--prefork with failures" "prelude\nhello world\nhello world\n" "${errors}" 70
+    --prefork prelude.lox --jobs 2 greet.lox runtime.lox compile.lox missing.lox greet.lox)
+
+# nothing is forked from a prelude that failed
+expect_run("--prefork with a failed prelude" ""
+    "Undefined variable 'greeting'.\n[line 1] in script\n" 70
+    --prefork runtime.lox greet.lox)
+expect_run("--prefork with a missing prelude" "" "Could not open file \"missing.lox\".\n" 74
+    --prefork missing.lox greet.lox)
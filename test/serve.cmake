@@ -0,0 +1,59 @@
+# Starts a --serve daemon and sends it scripts with --connect: source, a runtime
+# error, a bytecode file from --compile and a script too big to take, and
+# starts a second daemon on the same socket, which has to refuse it. Then it
+# stops the first with SIGTERM. The daemon runs under timeout(1), so it goes
+# away on its own when a failed check ends the test before it is stopped.
+#
+#   cmake -DCLOX=path/to/clox -DWORK=path/to/scratch -P serve.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/expect.cmake)
+start_work()
+
+file(WRITE ${WORK}/hello.lox "var greeting = \"hello\";\nprint greeting + \" world\";\n")
+file(WRITE ${WORK}/runtime.lox "print \"runtime\";\nprint -\"runtime\";\n")
+execute_process(COMMAND head -c 16777217 /dev/zero
+    WORKING_DIRECTORY ${WORK} OUTPUT_FILE ${WORK}/big.lox)
+expect_run("--compile" "" "" 0 --compile hello.lox)
+
+execute_process(
+    COMMAND sh -c "timeout 60 '${CLOX}' --serve clox.sock --jobs 2 >serve.log 2>&1 & echo $! >serve.pid"
+    WORKING_DIRECTORY ${WORK})
+foreach(attempt RANGE 100)
+    if(EXISTS ${WORK}/clox.sock)
+        break()
+    endif()
+    execute_process(COMMAND sleep 0.05)
+endforeach()
+
+expect_run("source" "hello world\n" "" 0 --connect clox.sock hello.lox)
+expect_run("runtime error" "runtime\n" "Operand must be a number.\n[line 2] in script\n" 70
+    --connect clox.sock runtime.lox)
+expect_run("bytecode" "hello world\n" "" 0 --connect clox.sock hello.loxc)
+expect_run("script over the limit" "" "The script is larger than 16777216 bytes.\n" 74
+    --connect clox.sock big.lox)
+expect_run("after a script over the limit" "hello world\n" "" 0 --connect clox.sock hello.lox)
+
+# a second daemon leaves the socket to the one listening on it; its probe
+# counts as a script served
+expect_run("--serve on a live socket" ""
+    "A server is already serving on \"clox.sock\".\n" 74
+    --serve clox.sock)
+expect_run("after a second --serve" "hello world\n" "" 0 --connect clox.sock hello.lox)
+
+file(READ ${WORK}/serve.pid pid)
+string(STRIP ${pid} pid)
+execute_process(COMMAND kill -TERM ${pid})
+
+# the daemon says how many scripts it served once it has stopped
+foreach(attempt RANGE 100)
+    file(READ ${WORK}/serve.log log)
+    if(log MATCHES "Served")
+        break()
+    endif()
+    execute_process(COMMAND sleep 0.05)
+endforeach()
+set(expectedlog "Serving on \"clox.sock\" with 2 workers.\nServed 7 scripts.\n")
+if(NOT log STREQUAL expectedlog)
+    message(FATAL_ERROR "the server's errors are not what they should be.\n"
+        "expected:\n${expectedlog}\ngot:\n${log}")
+endif()